@@ -1,39 +1,97 @@
+#define _XOPEN_SOURCE 700
+
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define VERSION 6
-
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define VERSION 7
+
+#define MAX_BATCH_COUNT 64
+#define MAX_CHANNEL_COUNT 64
+#define MAX_CHANNEL_LENGTH 64
 #define MAX_ENV_SIZE 64
 #define MAX_ERROR_LENGTH 1024
-#define MAX_FORM_COUNT 512
+#define MAX_FIBER_COUNT 64
+#define MAX_FIBER_DEPTH 16
+#define MAX_FORK_COUNT 64
+#define MAX_FORM_COUNT 16384
 #define MAX_FRAME_COUNT 64
 #define MAX_FUNC_COUNT 64
 #define MAX_FUNC_ARG_COUNT 8
 #define MAX_FUNC_RET_COUNT 8
+#define MAX_IN_LENGTH 65536
+#define MAX_LINES_COUNT 4
+#define MAX_LIT_COUNT 4096
+#define MAX_MACRO_COUNT 16
+#define MAX_MODULE_COUNT 16
 #define MAX_NAME_LENGTH 64
+#define MAX_NODE_COUNT 4096
 #define MAX_OP_COUNT 1024
 #define MAX_POS_SOURCE_LENGTH 255
 #define MAX_REG_COUNT 64
+#define MAX_RESPAWN_DELAY 5000
 #define MAX_SCOPE_COUNT 8
+#define MAX_SECTION_COUNT 4
+#define MAX_SOURCE_COUNT 16
 #define MAX_STACK_SIZE 64
+#define MAX_STAGE_COUNT 8
 #define MAX_STATE_COUNT 64
+#define MAX_SYM_CHAR_COUNT 65536
+#define MAX_SYM_COUNT 4096
+#define MAX_WORKER_COUNT 8
+#define MIN_RESPAWN_DELAY 100
+#define MIN_WORKER_LIFETIME 1000
 
 typedef int16_t reg_t;
 typedef int32_t int_t;
 typedef uint16_t nrefs_t;
+typedef uint32_t form_t;
+typedef uint32_t sym_t;
 
 enum emit_res {EMIT_OK, EMIT_ERROR}; 
-enum eval_res {EVAL_OK, EVAL_ERROR};
+enum eval_res {EVAL_OK, EVAL_ERROR, EVAL_YIELD};
 enum read_res {READ_OK, READ_NULL, READ_ERROR};
 
+/*** Probes
+     Static tracepoints for bpftrace/perf, compiled in with -DUSE_SDT.
+     Each probe is a single NOP until a tracer attaches.
+***/
+
+#ifdef USE_SDT
+#include <sys/sdt.h>
+
+#define PROBE(name, ...)			\
+  STAP_PROBEV(fibr, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...)
+#endif
+
 #define BASEOF(p, t, m) ({			\
       uint8_t *_p = (uint8_t *)(p);		\
       _p ? ((t *)(_p - offsetof(t, m))) : NULL;	\
@@ -86,12 +144,11 @@ struct ls *ls_del(struct ls *self) {
   _LS_DO(in, i, UNIQUE(next))
 
 struct pos {
-  char source[MAX_POS_SOURCE_LENGTH];
-  uint16_t line, column;
+  uint16_t source, line, column;
 };
 
-struct pos *pos_init(struct pos *self, const char *source, int line, int column) {
-  strcpy(self->source, source);
+struct pos *pos_init(struct pos *self, uint16_t source, int line, int column) {
+  self->source = source;
   self->line = line;
   self->column = column;
   return self;
@@ -101,23 +158,31 @@ struct pos *pos_init(struct pos *self, const char *source, int line, int column)
      Types define behavior for values and are used for type-checking at compile- and runtime.
 ***/
 
-struct form;
+struct form_range;
 struct val;
 struct vm;
 
+/* Tags are compact ids for types, for storing values where a pointer per type is too much. */
+
+enum type_tag {TAG_NULL, TAG_BOOL, TAG_CHAN, TAG_DICT, TAG_FUNC, TAG_INT, TAG_MACRO, TAG_META, TAG_QUOTE, TAG_REG, TAG_SLICE, TAG_STR,
+	       TAG_VEC};
+
 struct type {
   char name[MAX_NAME_LENGTH];
+  enum type_tag tag;
   
   struct { 
     void (*dump)(struct val *val, FILE *out);
-    enum emit_res (*emit)(struct val *val, struct form *form, struct ls *in, struct vm *vm);
+    enum emit_res (*emit)(struct val *val, form_t form, struct form_range *in, struct vm *vm);
     bool (*equal)(struct val *x, struct val *y);
+    uint32_t (*hash)(struct val *val);
     bool (*is_true)(struct val *val);
     struct val *(*lit)(struct val *val);
+    uint8_t (*nargs)(struct val *val);
   } methods;
 };
 
-enum emit_res default_emit(struct val *val, struct form *form, struct ls *in, struct vm *vm);
+enum emit_res default_emit(struct val *val, form_t form, struct form_range *in, struct vm *vm);
 
 bool default_true(struct val *val) {
   return true;
@@ -127,14 +192,21 @@ struct val *default_lit(struct val *val) {
   return val;
 }
 
-struct type *type_init(struct type *self, const char *name) {
+uint8_t default_nargs(struct val *val) {
+  return 0;
+}
+
+struct type *type_init(struct type *self, const char *name, enum type_tag tag) {
   assert(strlen(name) < MAX_NAME_LENGTH);
   strcpy(self->name, name);
+  self->tag = tag;
   self->methods.dump = NULL;
   self->methods.emit = default_emit;
   self->methods.equal = NULL;
+  self->methods.hash = NULL;
   self->methods.is_true = default_true;
   self->methods.lit = default_lit;
+  self->methods.nargs = default_nargs;
   return self;
 }
 
@@ -145,19 +217,30 @@ struct type *type_init(struct type *self, const char *name) {
 
 struct func;
 struct macro;
+struct slice;
 struct type;
 
+/* Payloads are shared with the slots of separately tagged states. */
+
+#define VAL_PAYLOAD				\
+  union {					\
+    bool as_bool;				\
+    struct channel *as_channel;			\
+    struct node *as_dict;			\
+    struct func *as_func;			\
+    int_t as_int;				\
+    struct macro *as_macro;			\
+    struct type *as_meta;			\
+    form_t as_quote;				\
+    reg_t as_reg;				\
+    struct slice *as_slice;			\
+    const char *as_str;				\
+    struct node *as_vec;			\
+  }
+
 struct val {
   struct type *type;
-
-  union {
-    bool as_bool;
-    struct func *as_func;
-    int_t as_int;
-    struct macro *as_macro;
-    struct type *as_meta;
-    reg_t as_reg;
-  };
+  VAL_PAYLOAD;
 };
 
 struct val *val_init(struct val *self, struct type *type) {
@@ -199,6 +282,8 @@ struct ls *env_find(struct env *self, const char *name) {
   return &self->order;
 }
 
+/* Returns NULL if name is already bound or the env is full. */
+
 struct val *env_set(struct env *self, const char *name) {
   struct ls *found = env_find(self, name);
 
@@ -209,9 +294,9 @@ struct val *env_set(struct env *self, const char *name) {
       return NULL;
     }
   }
- 
+
+  if (self->item_count == MAX_ENV_SIZE) { return NULL; }
   struct env_item *it = self->items + self->item_count++;
-  assert(it < self->items+MAX_ENV_SIZE);
   strcpy(it->name, name);
   ls_ins(found, &it->order);
   return &it->val;
@@ -219,8 +304,9 @@ struct val *env_set(struct env *self, const char *name) {
 
 struct val *env_get(struct env *self, const char *name) {
   struct ls *found = env_find(self, name);
-  assert(found != &self->order);
-  return &BASEOF(found, struct env_item, order)->val;
+  if (found == &self->order) { return NULL; }
+  struct env_item *it = BASEOF(found, struct env_item, order);
+  return strcmp(it->name, name) == 0 ? &it->val : NULL;
 }
 
 /*** Operations ***
@@ -263,8 +349,11 @@ struct op_push {
   struct val val;
 };
 
+/* Return values are only checked against the func's types when they aren't known when compiling. */
+
 struct op_ret {
   struct func *func;
+  bool check;
 };
 
 struct op_store {
@@ -278,7 +367,7 @@ enum op_code {
 
 struct op {
   enum op_code code;
-  struct form *form;
+  form_t form;
   
   union {
     struct op_branch as_branch;
@@ -293,7 +382,7 @@ struct op {
   };
 };
 
-struct op *op_init(struct op *self, enum op_code code, struct form *form) {
+struct op *op_init(struct op *self, enum op_code code, form_t form) {
   self->code = code;
   self->form = form;
 
@@ -323,6 +412,7 @@ struct op *op_init(struct op *self, enum op_code code, struct form *form) {
     break;
   case OP_RET:
     self->as_ret.func = NULL;
+    self->as_ret.check = false;
     break;
   case OP_STORE:
     self->as_store.reg = -1;
@@ -334,6 +424,23 @@ struct op *op_init(struct op *self, enum op_code code, struct form *form) {
   return self;
 }
 
+/* Moves op from one code area to another, pc operands are assumed to point into the same area. */
+
+struct op *op_move(struct op *self, struct op *from, struct op *to) {
+  switch (self->code) {
+  case OP_BRANCH:
+    self->as_branch.false_pc = to + (self->as_branch.false_pc - from);
+    break;
+  case OP_JUMP:
+    self->as_jump.pc = to + (self->as_jump.pc - from);
+    break;
+  default:
+    break;
+  }
+
+  return self;
+}
+
 void func_dump(struct func *self, FILE *out);
 void val_dump(struct val *self, FILE *out);
 
@@ -372,6 +479,7 @@ void op_dump(struct op *self, FILE *out) {
   case OP_RET:
     fprintf(out, "RET ");
     func_dump(self->as_ret.func, out);
+    if (self->as_ret.check) { fputs(" CHECK", out); }
     break;
   case OP_STORE:
     fprintf(out, "STORE %" PRId16, self->as_store.reg);
@@ -383,70 +491,123 @@ void op_dump(struct op *self, FILE *out) {
   }
 }
 
-/*** Forms ***
-     Code is read as forms, which are then emitted as operations.
-     Each form carries its source position.
+/*** Symbols
+     Symbols are interned names, stored back to back and found through an open addressed hash table.
 ***/
 
-struct form_group {
-  struct ls items;
-};
+#define SYM_NULL UINT32_MAX
 
-struct form_id {
-  char name[MAX_NAME_LENGTH];
+struct syms {
+  char chars[MAX_SYM_CHAR_COUNT];
+  uint32_t char_count;
+  uint32_t starts[MAX_SYM_COUNT];
+  sym_t count;
+  sym_t table[MAX_SYM_COUNT*2];
 };
 
-struct form_lit {
-  struct val val;
-};
+struct syms *syms_init(struct syms *self) {
+  self->char_count = 0;
+  self->count = 0;
+  memset(self->table, 0, sizeof(self->table));
+  return self;
+}
+
+const char *sym_name(struct syms *self, sym_t sym) {
+  return self->chars + self->starts[sym];
+}
+
+/* Returns SYM_NULL once the table is full. */
+
+sym_t sym(struct syms *self, const char *name, size_t length) {
+  uint32_t h = 2166136261u;
+  for (const char *c = name; c < name + length; c++) { h = (h ^ (uint8_t)*c) * 16777619u; }
+  const uint32_t mask = MAX_SYM_COUNT*2 - 1;
+  
+  for (uint32_t i = h & mask;; i = (i+1) & mask) {
+    sym_t s = self->table[i];
+
+    if (!s) {
+      if (self->count == MAX_SYM_COUNT || self->char_count + length >= MAX_SYM_CHAR_COUNT) { return SYM_NULL; }
+      s = self->count++;
+      self->starts[s] = self->char_count;
+      memcpy(self->chars + self->char_count, name, length);
+      self->char_count += length;
+      self->chars[self->char_count++] = 0;
+      self->table[i] = s+1;
+      return s;
+    }
+
+    const char *sn = sym_name(self, s-1);
+    if (strncmp(sn, name, length) == 0 && !sn[length]) { return s-1; }
+  }
+}
+
+/*** Forms ***
+     Code is read as forms, which are then emitted as operations.
+     Forms are stored flat in read order as parallel arrays indexed by form_t,
+     each group is immediately followed by its items and knows where they end.
+     Each form carries its source position.
+***/
+
+#define FORM_NULL UINT32_MAX
 
 enum form_type {FORM_GROUP, FORM_ID, FORM_LIT, FORM_SEMI};
 
-struct form {
-  struct ls ls;
-  enum form_type type;
-  struct pos pos;
+/* Forms below start belong to the snapshot the VM was cloned from. */
 
-  union {
-    struct form_group as_group;
-    struct form_id as_id;
-    struct form_lit as_lit;
-  };
+struct forms {
+  uint8_t types[MAX_FORM_COUNT];
+  uint32_t data[MAX_FORM_COUNT];
+  form_t ends[MAX_FORM_COUNT];
+  struct pos pos[MAX_FORM_COUNT];
+  form_t start, count;
+
+  struct val lits[MAX_LIT_COUNT];
+  uint32_t lit_count;
 };
 
-struct form *form_init(struct form *self, enum form_type type, struct pos pos, struct ls *out) {
-  self->type = type;
-  self->pos = pos;
-  if (out) { ls_ins(out, &self->ls); }
+struct forms *forms_init(struct forms *self, form_t start) {
+  self->start = self->count = start;
+  self->lit_count = 0;
+  return self;
+}
 
-  switch (type) {
-  case FORM_GROUP:
-    ls_init(&self->as_group.items);
-    break;
-  case FORM_LIT:
-    self->as_lit.val.type = NULL;
-    break;
-  case FORM_ID:
-  case FORM_SEMI:
-    break;
-  }
+/* A range of sibling forms, consumed from the front by emitters. */
+
+struct form_range {
+  form_t start, end;
+};
 
+struct form_range *form_range_init(struct form_range *self, form_t start, form_t end) {
+  self->start = start;
+  self->end = end;
   return self;
 }
 
+bool form_range_null(const struct form_range *self) {
+  return self->start == self->end;
+}
+
+enum form_type form_type(struct vm *vm, form_t form);
+const char *form_id(struct vm *vm, form_t form);
+struct val *form_lit(struct vm *vm, form_t form);
+struct pos form_pos(struct vm *vm, form_t form);
+struct form_range form_items(struct vm *vm, form_t form);
+form_t pop_form(struct vm *vm, struct form_range *in);
+
 struct val *find(struct vm *vm, const char *name);
 struct val *val_lit(struct val *self);
 
-struct val *form_val(struct form *self, struct vm *vm) {
-  switch (self->type) {
+struct val *form_val(form_t self, struct vm *vm) {
+  switch (form_type(vm, self)) {
   case FORM_ID: {
-    struct val *v = find(vm, self->as_id.name);
+    struct val *v = find(vm, form_id(vm, self));
     if (!v) { break; }
     return val_lit(v);
   }
     
   case FORM_LIT:
-    return &self->as_lit.val;
+    return form_lit(vm, self);
 
   case FORM_GROUP:
   case FORM_SEMI:
@@ -456,25 +617,24 @@ struct val *form_val(struct form *self, struct vm *vm) {
   return NULL;
 }
 
-struct op *emit(struct vm *vm, enum op_code code, struct form *form);
+struct op *emit(struct vm *vm, enum op_code code, form_t form);
 
-enum emit_res default_emit(struct val *val, struct form *form, struct ls *in, struct vm *vm) {
+enum emit_res default_emit(struct val *val, form_t form, struct form_range *in, struct vm *vm) {
   emit(vm, OP_PUSH, form)->as_push.val = *val;
   return EMIT_OK;
 }
 
 void error(struct vm *vm, struct pos pos, const char *fmt, ...);
-enum emit_res val_emit(struct val *self, struct form *form, struct ls *in, struct vm *vm);
+enum emit_res val_emit(struct val *self, form_t form, struct form_range *in, struct vm *vm);
 
-enum emit_res form_emit(struct form *self, struct ls *in, struct vm *vm) {
-  switch (self->type) {
+enum emit_res form_emit(form_t self, struct form_range *in, struct vm *vm) {
+  switch (form_type(vm, self)) {
   case FORM_GROUP: {
-    struct ls *items = &self->as_group.items;
+    struct form_range items = form_items(vm, self);
     
-    for (struct ls *it = items->next; it != items; it = items->next) {
-      ls_del(it);
-      struct form *f = BASEOF(it, struct form, ls);
-      enum emit_res res = form_emit(f, items, vm);
+    while (!form_range_null(&items)) {
+      form_t f = pop_form(vm, &items);
+      enum emit_res res = form_emit(f, &items, vm);
       if (res != EMIT_OK) { return res; }
     }
 
@@ -482,7 +642,7 @@ enum emit_res form_emit(struct form *self, struct ls *in, struct vm *vm) {
   }
     
   case FORM_ID: {
-    const char *name = self->as_id.name;
+    const char *name = form_id(vm, self);
     uint8_t drop_count = 0;
     
     for (const char *c = name; *c; c++, drop_count++) {
@@ -500,7 +660,7 @@ enum emit_res form_emit(struct form *self, struct ls *in, struct vm *vm) {
     struct val *v = find(vm, name);
 
     if (!v) {
-      error(vm, self->pos, "Unknown id: %s", name);
+      error(vm, form_pos(vm, self), "Unknown id: %s", name);
       return EMIT_ERROR;
     }
     
@@ -508,48 +668,47 @@ enum emit_res form_emit(struct form *self, struct ls *in, struct vm *vm) {
   }
     
   case FORM_LIT:
-    emit(vm, OP_PUSH, self)->as_push.val = self->as_lit.val;
+    emit(vm, OP_PUSH, self)->as_push.val = *form_lit(vm, self);
     return EMIT_OK;
   case FORM_SEMI:
-    error(vm, self->pos, "Semi emit");
+    error(vm, form_pos(vm, self), "Semi emit");
     break;
   }
   
   return EMIT_ERROR;
 }
 
-enum emit_res emit_forms(struct vm *vm, struct ls *in) {
-  while (!ls_null(in)) {
-    struct form *f = BASEOF(ls_del(in->next), struct form, ls);
-    enum emit_res fr = form_emit(f, in, vm);
-    if (fr != EMIT_OK) { return fr; }
-  }
-
-  return EMIT_OK;
-}
-
 /*** Macros
  ***/
 
-typedef enum emit_res (*macro_body_t)(struct macro *self, struct form *form, struct ls *in, struct vm *vm);
+typedef enum emit_res (*macro_body_t)(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+
+/* Macros consume exactly nargs forms, which is used to find the extent of func bodies before emitting them;
+   args with their bit set in quoted are taken as a single form, anything else is skipped like a call.
+   Macros defined in fibr evaluate their func at emit time. */
 
 struct macro {
   char name[MAX_NAME_LENGTH];
-  uint8_t nargs;
+  uint8_t nargs, quoted;
   macro_body_t body;
+  struct func *func;
 };
 
-struct macro *macro_init(struct macro *self, const char *name, uint8_t nargs, macro_body_t body) {
+struct macro *macro_init(struct macro *self, const char *name, uint8_t nargs, uint8_t quoted, macro_body_t body) {
   assert(strlen(name) < MAX_NAME_LENGTH);
   strcpy(self->name, name);
   self->nargs = nargs;
+  self->quoted = quoted;
   self->body = body;
+  self->func = NULL;
   return self;
 }
 
 /*** Functions
  ***/
 
+/* Bodies return the pc to continue from, or NULL once they've reported an error. */
+
 typedef struct op *(*func_body_t)(struct func *self, struct op *ret_pc, struct vm *vm);
 
 struct func_arg {
@@ -576,8 +735,8 @@ struct func_arg arg(const char *name, struct type *type) {
   
 struct func *func_init(struct func *self,
 		       const char *name,
-		       uint8_t nargs, struct func_arg args[],
-		       uint8_t nrets, struct type *rets[],
+		       uint8_t nargs, struct func_arg *args,
+		       uint8_t nrets, struct type **rets,
 		       func_body_t body) {
   assert(strlen(name) < MAX_NAME_LENGTH);
   strcpy(self->name, name);
@@ -594,15 +753,73 @@ void func_dump(struct func *self, FILE *out) {
   fputs(self->name, out);
 }
 
+bool emit_full(struct vm *vm, form_t form);
 struct op *pc(struct vm *vm);
 
-enum emit_res func_emit(struct func *self, struct form *form, struct ls *in, struct vm *vm) {
+static struct type bool_type, chan_type, dict_type, func_type, int_type, macro_type, meta_type, quote_type, reg_type,
+  slice_type, str_type, vec_type;
+
+/* Returns true if op leaves values of the func's return types on top of the stack. */
+
+bool rets_typed(struct func *self, struct op *op) {
+  switch (op->code) {
+  case OP_CALL: {
+    struct func *f = op->as_call.func;
+    if (f->nrets < self->nrets) { return false; }
+    
+    for (uint8_t i = 0; i < self->nrets; i++) {
+      if (f->rets[f->nrets - self->nrets + i] != self->rets[i]) { return false; }
+    }
+
+    return true;
+  }
+  case OP_EQUAL:
+    return self->nrets == 1 && self->rets[0] == &bool_type;
+  case OP_PUSH:
+    return self->nrets == 1 && self->rets[0] == op->as_push.val.type;
+  default:
+    return false;
+  }
+}
+
+/* Return values are known when every path to end comes from an op that is typed to match,
+   declared return types of called funcs are trusted since they are checked when they return. */
+
+bool rets_known(struct func *self, struct op *start, struct op *end) {
+  struct type **r = self->rets;
+  while (r < self->rets + self->nrets && !*r) { r++; }
+  if (r == self->rets + self->nrets) { return true; }
+  if (end == start || !rets_typed(self, end-1)) { return false; }
+
+  for (struct op *op = start; op < end; op++) {
+    if (op->code == OP_BRANCH && op->as_branch.false_pc == end) { return false; }
+    
+    if (op->code == OP_JUMP && op->as_jump.pc == end && (op == start || !rets_typed(self, op-1))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void emit_ret(struct vm *vm, struct func *func, struct op *start, form_t form) {
+  struct op *end = pc(vm);
+  struct op_ret *ret = &emit(vm, OP_RET, form)->as_ret;
+  ret->func = func;
+  ret->check = !rets_known(func, start, end);
+}
+
+/* start_pc is only set once the body has been compiled, which is when redefinitions take effect. */
+
+enum emit_res func_emit(struct func *self, form_t form, struct form_range *in, struct vm *vm) {
   struct op_jump *skip = &emit(vm, OP_JUMP, form)->as_jump;
-  self->start_pc = pc(vm);
+  struct op *start_pc = pc(vm);
   enum emit_res res = form_emit(form, in, vm);
   if (res != EMIT_OK) { return res; }
-  emit(vm, OP_RET, form)->as_ret.func = self;
+  emit_ret(vm, self, start_pc, form);
+  if (emit_full(vm, form)) { return EMIT_ERROR; }
   skip->pc = pc(vm);
+  self->start_pc = start_pc;
   return EMIT_OK;
 }
 
@@ -612,771 +829,5901 @@ struct scope {
   reg_t reg_count;
 };
 
+/* States hold the registers and stack of a frame. 
+   Building with -DUSE_SOA stores payloads and type tags in separate arrays, 
+   which packs Int-heavy stacks in half the cache lines and leaves payloads contiguous for vector ops. 
+   Either way, values are accessed through slots, which are the payloads of the layout in use. */
+
+#ifdef USE_SOA
+
+struct slot {
+  VAL_PAYLOAD;
+};
+
+typedef struct slot slot_t;
+
+struct state {
+  slot_t regs[MAX_REG_COUNT];
+  slot_t stack[MAX_STACK_SIZE];
+  uint8_t reg_tags[MAX_REG_COUNT];
+  uint8_t stack_tags[MAX_STACK_SIZE];
+  uint8_t stack_size;
+};
+
+#else
+
+typedef struct val slot_t;
+
 struct state {
-  struct val regs[MAX_REG_COUNT];
-  struct val stack[MAX_STACK_SIZE];
+  slot_t regs[MAX_REG_COUNT];
+  slot_t stack[MAX_STACK_SIZE];
   uint8_t stack_size;
 };
 
+#endif
+
 struct frame {
   struct func *func;
   struct op *ret_pc;
 };
 
-/*** Virtual Machines
-     The VM is the engine of the interpreter, the one struct to rule them all.
+/*** Inputs
+     Inputs buffer code in memory for the readers, refilling from a file descriptor whenever they run dry.
+     Read errors are kept in the input rather than the VM, since reading may run on a separate thread.
+     Scanning runs of characters is done 16/32 bytes at a time when SSE2/AVX2 is available.
 ***/
 
-struct vm {
-  struct type bool_type, func_type, int_type, meta_type;
-
-  struct func funcs[MAX_FUNC_COUNT];
-  uint32_t func_count;
-  
-  struct form forms[MAX_FORM_COUNT];
-  uint32_t form_count;
-  
-  struct scope scopes[MAX_SCOPE_COUNT];
-  uint32_t scope_count;
-
-  struct op ops[MAX_OP_COUNT];
-  uint32_t op_count;
-
-  struct state states[MAX_STATE_COUNT];
-  uint32_t state_count;
-
-  struct frame frames[MAX_FRAME_COUNT];
-  uint32_t frame_count;
-
+struct in {
+  int fd;
+  char *start, *end;
+  char buf[MAX_IN_LENGTH];
   char error[MAX_ERROR_LENGTH];
-  bool debug;
 };
 
-struct val *bind_init(struct vm *vm, const char *name, struct type *type);
-struct scope *push_scope(struct vm *vm);
-
-void bool_dump(struct val *val, FILE *out) {
-  fputs(val->as_bool ? "T" : "F", out);
+struct in *in_init(struct in *self, int fd) {
+  self->fd = fd;
+  self->start = self->end = self->buf;
+  *self->error = 0;
+  return self;
 }
 
-bool bool_equal(struct val *x, struct val *y) {
-  return x->as_bool == y->as_bool;
-}
+void format_error(char *out, struct vm *vm, struct pos pos, const char *fmt, va_list args);
 
-bool bool_true(struct val *val) {
-  return val->as_bool;
+void in_error(struct in *self, struct vm *vm, struct pos pos, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  format_error(self->error, vm, pos, fmt, args);
+  va_end(args);
 }
 
-void func_val_dump(struct val *val, FILE *out) {
-  func_dump(val->as_func, out);
+bool in_fill(struct in *self) {
+  if (self->fd == -1) { return false; }
+  size_t n = self->end - self->start;
+  if (n == MAX_IN_LENGTH) { return false; }
+  memmove(self->buf, self->start, n);
+  self->start = self->buf;
+  self->end = self->buf + n;
+  ssize_t r = read(self->fd, self->end, MAX_IN_LENGTH - n);
+
+  if (r <= 0) {
+    self->fd = -1;
+    return false;
+  }
+  
+  self->end += r;
+  return true;
 }
 
-enum emit_res func_val_emit(struct val *val, struct form *form, struct ls *in, struct vm *vm) {
-  for (uint8_t i = 0; i < val->as_func->nargs; i++) {
-    struct form *f = BASEOF(ls_del(in->next), struct form, ls);
-    enum emit_res res = form_emit(f, in, vm);
-    if (res != EMIT_OK) { return res; }
+bool in_want(struct in *self, size_t n) {
+  while (self->end - self->start < n) {
+    if (!in_fill(self)) { return false; }
   }
-       
-  emit(vm, OP_CALL, form)->as_call.func = val->as_func;
-  return EMIT_OK;
-}
 
-struct val *func_val_lit(struct val *val) {
-  return NULL;
+  return true;
 }
 
-void int_dump(struct val *val, FILE *out) {
-  fprintf(out, "%" PRId32, val->as_int);
+char in_peek(struct in *self) {
+  return in_want(self, 1) ? *self->start : 0;
 }
 
-bool int_equal(struct val *x, struct val *y) {
-  return x->as_int == y->as_int;
+bool in_eof(struct in *self) {
+  return !in_want(self, 1);
 }
 
-bool int_true(struct val *val) {
-  return val->as_int;
+static const bool delims[256] = {
+  [0] = true, [' '] = true, ['\t'] = true, ['\n'] = true, ['\r'] = true,
+  ['('] = true, [')'] = true, [';'] = true
+};
+
+#if defined(__SSE2__)
+static inline __m128i sse_delims(__m128i c) {
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\t')));
+  m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))));
+  m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('(')), _mm_cmpeq_epi8(c, _mm_set1_epi8(')'))));
+  return _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(';')), _mm_cmpeq_epi8(c, _mm_setzero_si128())));
 }
+#endif
+
+#if defined(__AVX2__)
+static inline __m256i avx_delims(__m256i c) {
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t')));
+  m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')),
+					 _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r'))));
+  m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('(')),
+					 _mm256_cmpeq_epi8(c, _mm256_set1_epi8(')'))));
+  return _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(';')),
+					    _mm256_cmpeq_epi8(c, _mm256_setzero_si256())));
+}
+#endif
 
-void meta_dump(struct val *val, FILE *out) {
-  fputs(val->as_meta->name, out);
+/* Returns the first delimiter in [p, end), or end. */
+
+char *scan_id(char *p, char *end) {
+#if defined(__AVX2__)
+  for (; p + 32 <= end; p += 32) {
+    uint32_t m = _mm256_movemask_epi8(avx_delims(_mm256_loadu_si256((const __m256i *)p)));
+    if (m) { return p + __builtin_ctz(m); }
+  }
+#endif
+
+#if defined(__SSE2__)
+  for (; p + 16 <= end; p += 16) {
+    uint32_t m = _mm_movemask_epi8(sse_delims(_mm_loadu_si128((const __m128i *)p)));
+    if (m) { return p + __builtin_ctz(m); }
+  }
+#endif
+
+  while (p < end && !delims[(uint8_t)*p]) { p++; }
+  return p;
 }
 
-struct vm *vm_init(struct vm *self) {
-  self->scope_count = 0;
+/* Returns the first character in [p, end) that isn't a space or tab, or end. */
 
-  for (struct scope *s = self->scopes, *ps = NULL; s < self->scopes+MAX_SCOPE_COUNT; ps = s, s++) {
-    s->parent_scope = ps;
+char *scan_blank(char *p, char *end) {
+#if defined(__AVX2__)
+  for (; p + 32 <= end; p += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t m = ~_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+						       _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t'))));
+    if (m) { return p + __builtin_ctz(m); }
+  }
+#endif
+
+#if defined(__SSE2__)
+  for (; p + 16 <= end; p += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    uint32_t m = ~_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+						 _mm_cmpeq_epi8(c, _mm_set1_epi8('\t')))) & 0xffff;
+    if (m) { return p + __builtin_ctz(m); }
   }
+#endif
 
-  self->func_count = 0;
-  self->frame_count = 0;
-  self->op_count = 0;
-  self->state_count = 0;
-  self->frame_count = 0;
-  *self->error = 0;
-  self->debug = false;
-  push_scope(self);
+  while (p < end && (*p == ' ' || *p == '\t')) { p++; }
+  return p;
+}
 
-  type_init(&self->meta_type, "Meta");
-  self->meta_type.methods.dump = meta_dump;
-  bind_init(self, "Meta", &self->meta_type)->as_meta = &self->meta_type;
+/* Parses n (1-8) digits at p, reads 8 bytes regardless. */
+
+uint32_t swar_digits(const char *p, uint8_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  v -= 0x3030303030303030;
+  v <<= 8 * (8 - n);
+  v = (v * 10) + (v >> 8);
+  v = (((v & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+       (((v >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+  return v;
+#else
+  uint32_t v = 0;
+  for (const char *c = p; c < p + n; c++) { v = v * 10 + *c - '0'; }
+  return v;
+#endif
+}
 
-  type_init(&self->bool_type, "Bool");
-  self->bool_type.methods.dump = bool_dump;
-  self->bool_type.methods.equal = bool_equal;  
-  self->bool_type.methods.is_true = bool_true;
-  bind_init(self, "Bool", &self->meta_type)->as_meta = &self->bool_type;
+/*** Lines
+     Lines are read through an input and returned as slices of its buffer, nothing is copied beyond filling the buffer.
+     Lines longer than MAX_IN_LENGTH are split, and slices are only valid until the next line is read.
+***/
 
-  bind_init(self, "T", &self->bool_type)->as_bool = true;
-  bind_init(self, "F", &self->bool_type)->as_bool = false;
+struct slice {
+  const char *start;
+  uint32_t length;
+};
 
-  type_init(&self->func_type, "Func");
-  self->func_type.methods.dump = func_val_dump;
-  self->func_type.methods.emit = func_val_emit;
-  self->func_type.methods.lit = func_val_lit;
-  bind_init(self, "Func", &self->meta_type)->as_meta = &self->func_type;
+struct lines {
+  int fd;
+  struct in in;
+  struct slice line;
+};
 
-  type_init(&self->int_type, "Int");
-  self->int_type.methods.dump = int_dump;
-  self->int_type.methods.equal = int_equal;
-  self->int_type.methods.is_true = int_true;
-  bind_init(self, "Int", &self->meta_type)->as_meta = &self->int_type;
+/* Opens path for reading lines, - means stdin. */
 
-  return self;
+bool lines_open(struct lines *self, const char *path) {
+  self->fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (self->fd == -1) { return false; }
+  in_init(&self->in, self->fd);
+  return true;
 }
 
-struct form *new_form(struct vm *vm, enum form_type type, struct pos pos, struct ls *out) {
-  struct form *self = vm->forms + vm->form_count++;
-  return form_init(self, type, pos, out);
-}
+bool lines_next(struct lines *self) {
+  struct in *in = &self->in;
+  char *nl = NULL;
+  
+  while (!(nl = memchr(in->start, '\n', in->end - in->start))) {
+    if (!in_fill(in)) {
+      if (in->start == in->end) { return false; }
+      nl = in->end;
+      break;
+    }
+  }
 
-void val_dump(struct val *self, FILE *out) {
-  assert(self->type->methods.dump);
-  self->type->methods.dump(self, out);
+  char *end = (nl > in->start && nl[-1] == '\r') ? nl-1 : nl;
+  self->line.start = in->start;
+  self->line.length = end - in->start;
+  in->start = (nl < in->end) ? nl+1 : nl;
+  return true;
 }
 
-enum emit_res val_emit(struct val *self, struct form *form, struct ls *in, struct vm *vm) {
-  assert(self->type->methods.emit);
-  return self->type->methods.emit(self, form, in, vm);
+void lines_close(struct lines *self) {
+  if (self->fd != STDIN_FILENO) { close(self->fd); }
 }
 
-bool val_equal(struct val *self, struct val *other) {
-  assert(self->type->methods.equal);
-  return self->type->methods.equal(self, other);
-}
+/*** Channels
+     Channels pass values between fibers through a ring buffer, send waits while it's full and recv while it's empty.
+     All fibers of a VM run on its thread, so the ring needs neither locks nor atomics.
+     Nothing is allocated, a capacity of zero gives the channel all MAX_CHANNEL_LENGTH slots of its ring.
+***/
 
-bool val_true(struct val *self) {
-  assert(self->type->methods.is_true);
-  return self->type->methods.is_true(self);
-}
+struct channel {
+  struct val items[MAX_CHANNEL_LENGTH];
+  uint32_t head, tail, capacity;
+};
 
-struct val *val_lit(struct val *self) {
-  assert(self->type->methods.lit);
-  return self->type->methods.lit(self);
-}
+/* A capacity of zero means as many values as fit. */
 
-struct state *state_init(struct state *self) {
-  memset(self->regs, 0, sizeof(self->regs));
-  self->stack_size = 0;
+struct channel *channel_init(struct channel *self, uint32_t capacity) {
+  assert(capacity <= MAX_CHANNEL_LENGTH);
+  self->head = self->tail = 0;
+  self->capacity = capacity ? capacity : MAX_CHANNEL_LENGTH;
   return self;
 }
 
-struct frame *frame_init(struct frame *self, struct func *func, struct op *ret_pc) {
-  self->func = func;
-  self->ret_pc = ret_pc;
-  return self;
+uint32_t channel_length(struct channel *self) {
+  return self->tail - self->head;
 }
 
-void verror(struct vm *vm, struct pos pos, const char *fmt, va_list args) {
-  int n = snprintf(vm->error, MAX_ERROR_LENGTH,
-		   "Error in %s, line %" PRIu16 " column %" PRIu16 ": ",
-		   pos.source, pos.line, pos.column);
-  
-  assert(vsnprintf(vm->error+n, MAX_ERROR_LENGTH-n, fmt, args) > 0);
+void channel_push(struct channel *self, struct val val) {
+  assert(channel_length(self) < MAX_CHANNEL_LENGTH);
+  self->items[self->tail++ % MAX_CHANNEL_LENGTH] = val;
 }
 
-void error(struct vm *vm, struct pos pos, const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  verror(vm, pos, fmt, args);
-  va_end(args);
+struct val channel_pop(struct channel *self) {
+  assert(channel_length(self));
+  return self->items[self->head++ % MAX_CHANNEL_LENGTH];
 }
 
-struct scope *scope_init(struct scope *self, struct vm *vm);
+/*** Collections
+     Vecs and Dicts are persistent tries of nodes that are never modified once built, updates copy the path they change
+     and share everything else with the original. Nodes are allocated from a pool per VM, 
+     nodes that are no longer reachable are collected into a free list once the pool runs low.
+     Collections built by a snapshot live in its pool, which keeps them valid and untouched in its clones.
 
-struct scope *push_scope(struct vm *vm) {
-  assert(vm->scope_count < MAX_SCOPE_COUNT);
-  return scope_init(vm->scopes+vm->scope_count++, vm);
-}
+     Vecs are 32-way tries indexed by position, Dicts are hash array mapped tries of 16-way nodes,
+     which keeps their key/value pairs the same size as Vec nodes.
+     Dict keys that still collide once the hash runs out share a node, which has room for MAP_WIDTH of them.
+***/
 
-struct scope *peek_scope(struct vm *vm) {
-  assert(vm->scope_count);
+#define NODE_BITS 5
+#define NODE_WIDTH (1 << NODE_BITS)
+#define MAP_BITS 4
+#define MAP_WIDTH (1 << MAP_BITS)
+
+struct map_entry {
+  struct val key, val;
+};
+
+/* Roots keep the count, Vec nodes the shift of their level; Dict entries in branches hold nodes in their val. */
+
+struct node {
+  uint32_t count;
+  uint16_t used, branches;
+  uint8_t shift;
+  bool marked;
+  
+  union {
+    struct node *children[NODE_WIDTH];
+    struct val items[NODE_WIDTH];
+    struct map_entry entries[MAP_WIDTH];
+  };
+};
+
+bool val_equal(struct val *self, struct val *other);
+
+/* Values of different types are never equal, except texts which share their hash. */
+
+bool item_equal(struct val *x, struct val *y) {
+  if (x->type != y->type && (!x->type->methods.hash || x->type->methods.hash != y->type->methods.hash)) { return false; }
+  return x->type->methods.equal && val_equal(x, y);
+}
+
+uint32_t node_count(struct node *self) {
+  return self ? self->count : 0;
+}
+
+struct node *new_node(struct vm *vm, struct node *src);
+
+struct val *vec_get(struct node *self, uint32_t i) {
+  if (i >= node_count(self)) { return NULL; }
+  struct node *n = self;
+  for (uint8_t s = self->shift; s; s -= NODE_BITS) { n = n->children[(i >> s) & (NODE_WIDTH-1)]; }
+  return n->items + (i & (NODE_WIDTH-1));
+}
+
+struct node *vec_put(struct vm *vm, struct node *node, uint8_t shift, uint32_t i, struct val val) {
+  struct node *self = new_node(vm, node);
+  if (!self) { return NULL; }
+  self->shift = shift;
+  
+  if (!shift) {
+    self->items[i & (NODE_WIDTH-1)] = val;
+    return self;
+  }
+
+  uint32_t j = (i >> shift) & (NODE_WIDTH-1);
+  struct node *c = vec_put(vm, node ? node->children[j] : NULL, shift - NODE_BITS, i, val);
+  if (!c) { return NULL; }
+  self->children[j] = c;
+  return self;
+}
+
+/* Returns a copy of self with the value at i replaced, i == count appends; NULL when out of nodes. */
+
+struct node *vec_set(struct vm *vm, struct node *self, uint32_t i, struct val val) {
+  uint32_t count = node_count(self);
+  uint8_t shift = self ? self->shift : 0;
+  assert(i <= count);
+  struct node top;
+  
+  if (i == count && count == (1ULL << (shift + NODE_BITS))) {
+    memset(&top, 0, sizeof(top));
+    top.children[0] = self;
+    self = &top;
+    shift += NODE_BITS;
+  }
+
+  struct node *root = vec_put(vm, self, shift, i, val);
+  if (!root) { return NULL; }
+  root->count = (i == count) ? count+1 : count;
+  root->shift = shift;
+  return root;
+}
+
+uint32_t val_hash(struct val *val) {
+  assert(val->type->methods.hash);
+  return val->type->methods.hash(val);
+}
+
+struct val *dict_get(struct node *self, struct val *key) {
+  uint32_t h = val_hash(key);
+
+  for (uint8_t s = 0; self; s += MAP_BITS) {
+    if (s >= 32) {
+      for (struct map_entry *e = self->entries; e < self->entries + MAP_WIDTH; e++) {
+	if ((self->used & (1 << (e - self->entries))) && item_equal(&e->key, key)) { return &e->val; }
+      }
+
+      return NULL;
+    }
+
+    uint8_t i = (h >> s) & (MAP_WIDTH-1);
+    if (!(self->used & (1 << i))) { return NULL; }
+    struct map_entry *e = self->entries + i;
+    if (!(self->branches & (1 << i))) { return item_equal(&e->key, key) ? &e->val : NULL; }
+    self = e->val.as_dict;
+  }
+
+  return NULL;
+}
+
+/* Adds entry to self, which is a fresh copy that's still private to the caller,
+   the nodes below it are copied on the way down. */
+
+bool dict_add(struct vm *vm, struct node *self, uint8_t shift, uint32_t hash, struct map_entry *entry, bool *found) {
+  if (shift >= 32) {
+    struct map_entry *free = NULL;
+    
+    for (struct map_entry *e = self->entries; e < self->entries + MAP_WIDTH; e++) {
+      if (!(self->used & (1 << (e - self->entries)))) {
+	if (!free) { free = e; }
+      } else if (item_equal(&e->key, &entry->key)) {
+	e->val = entry->val;
+	*found = true;
+	return true;
+      }
+    }
+
+    if (!free) { return false; }
+    *free = *entry;
+    self->used |= 1 << (free - self->entries);
+    return true;
+  }
+  
+  uint8_t i = (hash >> shift) & (MAP_WIDTH-1);
+  struct map_entry *e = self->entries + i;
+  
+  if (!(self->used & (1 << i))) {
+    *e = *entry;
+    self->used |= 1 << i;
+    return true;
+  }
+
+  if (self->branches & (1 << i)) {
+    struct node *c = new_node(vm, e->val.as_dict);
+    if (!c || !dict_add(vm, c, shift + MAP_BITS, hash, entry, found)) { return false; }
+    e->val.as_dict = c;
+    return true;
+  }
+
+  if (item_equal(&e->key, &entry->key)) {
+    e->val = entry->val;
+    *found = true;
+    return true;
+  }
+
+  struct node *c = new_node(vm, NULL);
+  bool f = false;
+  
+  if (!c ||
+      !dict_add(vm, c, shift + MAP_BITS, val_hash(&e->key), e, &f) ||
+      !dict_add(vm, c, shift + MAP_BITS, hash, entry, found)) {
+    return false;
+  }
+  
+  e->val.as_dict = c;
+  self->branches |= 1 << i;
+  return true;
+}
+
+/* Returns a copy of self with key set to val; NULL when out of nodes. */
+
+struct node *dict_set(struct vm *vm, struct node *self, struct val key, struct val val) {
+  struct node *root = new_node(vm, self);
+  bool found = false;
+  struct map_entry e = {.key = key, .val = val};
+  if (!root || !dict_add(vm, root, 0, val_hash(&key), &e, &found)) { return NULL; }
+  root->count = node_count(self) + !found;
+  return root;
+}
+
+/* Calls f for each key/value pair until it returns false. */
+
+bool dict_each(struct node *self, bool (*f)(struct map_entry *e, void *data), void *data) {
+  if (!self) { return true; }
+  
+  for (uint8_t i = 0; i < MAP_WIDTH; i++) {
+    if (!(self->used & (1 << i))) { continue; }
+    struct map_entry *e = self->entries + i;
+    
+    if (self->branches & (1 << i)) {
+      if (!dict_each(e->val.as_dict, f, data)) { return false; }
+    } else if (!f(e, data)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*** Timers
+     Timers are kept in a hierarchical wheel of TIMER_LEVEL_COUNT levels with TIMER_SLOT_COUNT slots each,
+     the first level ticks once per millisecond and each level spans all slots of the one below.
+     Adding and removing is O(1), occupied slots are tracked in a bit mask per level
+     which allows advancing straight to the next tick that expires timers or moves them down a level.
+     Timers beyond the range of the wheel go round the last level until they're in range.
+***/
+
+#define TIMER_LEVEL_COUNT 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOT_COUNT (1 << TIMER_SLOT_BITS)
+
+uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct timer {
+  struct ls ls;
+  uint64_t expires;
+  uint8_t level, slot;
+};
+
+struct timers {
+  struct ls slots[TIMER_LEVEL_COUNT][TIMER_SLOT_COUNT];
+  uint64_t used[TIMER_LEVEL_COUNT];
+  uint64_t now;
+  uint32_t count;
+};
+
+struct timers *timers_init(struct timers *self) {
+  for (struct ls *s = self->slots[0]; s < self->slots[0] + TIMER_LEVEL_COUNT * TIMER_SLOT_COUNT; s++) {
+    ls_init(s);
+  }
+  
+  memset(self->used, 0, sizeof(self->used));
+  self->now = now_ms();
+  self->count = 0;
+  return self;
+}
+
+void timers_insert(struct timers *self, struct timer *timer) {
+  assert(timer->expires >= self->now);
+  uint64_t delta = timer->expires - self->now;
+  uint8_t level = 0;
+
+  while (level < TIMER_LEVEL_COUNT-1 && delta >> ((level+1) * TIMER_SLOT_BITS)) { level++; }
+  uint8_t shift = level * TIMER_SLOT_BITS;
+  uint64_t at = (delta >> (shift + TIMER_SLOT_BITS)) ? (self->now >> shift) - 1 : timer->expires >> shift;
+  timer->level = level;
+  timer->slot = at % TIMER_SLOT_COUNT;
+  ls_ins(&self->slots[level][timer->slot], &timer->ls);
+  self->used[level] |= 1ULL << timer->slot;
+}
+
+void timers_unlink(struct timers *self, struct timer *timer) {
+  ls_del(&timer->ls);
+  
+  if (ls_null(&self->slots[timer->level][timer->slot])) {
+    self->used[timer->level] &= ~(1ULL << timer->slot);
+  }
+}
+
+/* Timers never expire before the next tick. */
+
+void timers_add(struct timers *self, struct timer *timer, uint64_t expires) {
+  timer->expires = (expires > self->now) ? expires : self->now+1;
+  timers_insert(self, timer);
+  self->count++;
+}
+
+void timers_remove(struct timers *self, struct timer *timer) {
+  timers_unlink(self, timer);
+  self->count--;
+}
+
+/* Returns the next tick after now where an occupied slot comes up, which is no later than the earliest expiry;
+   ticks where timers are only moved down a level wake callers early. */
+
+uint64_t timers_next(struct timers *self) {
+  uint64_t next = UINT64_MAX;
+  
+  for (uint8_t level = 0; level < TIMER_LEVEL_COUNT; level++) {
+    uint64_t used = self->used[level];
+    if (!used) { continue; }
+    uint8_t shift = level * TIMER_SLOT_BITS;
+    uint64_t at = (self->now >> shift) + 1;
+    uint8_t r = at % TIMER_SLOT_COUNT;
+    if (r) { used = (used >> r) | (used << (TIMER_SLOT_COUNT - r)); }
+    uint64_t tick = (at + __builtin_ctzll(used)) << shift;
+    if (tick < next) { next = tick; }
+  }
+
+  return next;
+}
+
+/* Advances the wheel to now and moves expired timers to the expired list, skipping ticks without occupied slots. */
+
+void timers_advance(struct timers *self, uint64_t now, struct ls *expired) {
+  while (self->now < now) {
+    uint64_t next = timers_next(self);
+    
+    if (next > now) {
+      self->now = now;
+      return;
+    }
+
+    self->now = next;
+    
+    for (uint8_t level = 1; level < TIMER_LEVEL_COUNT; level++) {
+      uint8_t shift = level * TIMER_SLOT_BITS;
+      if (self->now & ((1ULL << shift) - 1)) { break; }
+      uint8_t slot = (self->now >> shift) % TIMER_SLOT_COUNT;
+      self->used[level] &= ~(1ULL << slot);
+      
+      LS_DO(&self->slots[level][slot], t) {
+	ls_del(t);
+	timers_insert(self, BASEOF(t, struct timer, ls));
+      }
+    }
+
+    LS_DO(&self->slots[0][self->now % TIMER_SLOT_COUNT], t) {
+      timers_remove(self, BASEOF(t, struct timer, ls));
+      ls_ins(expired, t);
+    }
+  }
+}
+
+/*** Fibers
+     Fibers are cooperative threads of evaluation within a VM, the running fiber only gives way when it sleeps or a channel makes it wait.
+     The first fiber is whatever the host is evaluating, the rest are started by go and end when their func returns.
+     Once every fiber is asleep, the thread sleeps until the first timer expires.
+
+     The running fiber's states and frames live in the VM as usual and are copied out when it waits,
+     which leaves evaluation untouched but limits waiting fibers to MAX_FIBER_DEPTH states.
+***/
+
+enum fiber_status {FIBER_DONE, FIBER_READY, FIBER_SLEEPING, FIBER_WAITING};
+
+struct fiber {
+  enum fiber_status status;
+  struct channel *channel;
+  struct timer timer;
+  struct op *pc;
+  
+  /* Started fibers call their func followed by fiber-end. */
+  struct op start_ops[2];
+  
+  struct state states[MAX_FIBER_DEPTH];
+  uint32_t state_count;
+  struct frame frames[MAX_FIBER_DEPTH];
+  uint32_t frame_count;
+};
+
+/*** Sections
+     Sections allow compiling func bodies on separate threads, 
+     each thread emits into its own section which is then linked into the VM's ops.
+***/
+
+struct func_def {
+  struct func *func;
+  form_t form, body, end;
+  bool parallel;
+  struct section *section;
+  uint32_t start;
+};
+
+struct section {
+  struct vm *vm;
+  uint32_t def_start, index, stride;
+  
+  struct op ops[MAX_OP_COUNT];
+  uint32_t op_count;
+  bool ops_full;
+  struct scope scope;
+  
+  enum emit_res res;
+  char error[MAX_ERROR_LENGTH];
+};
+
+/* Set while compiling into a section, emit(), pc(), peek_scope() and error() follow it. */
+
+static _Thread_local struct section *emit_section = NULL;
+
+/* Modules are identified by file rather than by the path used to import them. */
+
+struct module {
+  dev_t dev;
+  ino_t ino;
+  uint16_t source;
+  struct func *init;
+  struct env exports;
+};
+
+/*** Virtual Machines
+     The VM is the engine of the interpreter, the one struct to rule them all.
+     Fields touched by eval() on every op come first and share a cache line, 
+     the tables behind them start on a line of their own.
+***/
+
+#define CACHE_LINE_SIZE 64
+
+struct vm {
+  _Alignas(CACHE_LINE_SIZE) struct state *state;
+  uint32_t state_count, frame_count;
+  uint64_t fuel, fuel_tank, deadline;
+  bool debug;
+  
+  _Alignas(CACHE_LINE_SIZE) struct vm *snapshot;
+  bool frozen;
+  
+  struct func funcs[MAX_FUNC_COUNT];
+  uint32_t func_count;
+
+  struct macro macros[MAX_MACRO_COUNT];
+  uint32_t macro_count, expand_depth;
+
+  struct module modules[MAX_MODULE_COUNT];
+  uint32_t module_count;
+  
+  struct forms forms;
+  struct syms syms;
+  pthread_mutex_t read_lock;
+
+  char sources[MAX_SOURCE_COUNT][MAX_POS_SOURCE_LENGTH];
+  uint16_t source_count;
+  
+  struct scope scopes[MAX_SCOPE_COUNT];
+  uint32_t scope_count;
+
+  struct op ops[MAX_OP_COUNT];
+  uint32_t op_count;
+  bool ops_full;
+
+  struct func_def defs[MAX_FUNC_COUNT];
+  uint32_t def_count;
+  struct section sections[MAX_SECTION_COUNT];
+  
+  struct state states[MAX_STATE_COUNT];
+  struct frame frames[MAX_FRAME_COUNT];
+
+  struct lines lines[MAX_LINES_COUNT];
+  uint8_t lines_count;
+
+  struct channel channels[MAX_CHANNEL_COUNT];
+  uint32_t channel_count;
+
+  struct node nodes[MAX_NODE_COUNT];
+  uint32_t node_count, free_node_count;
+  struct node *free_nodes;
+  struct pin *pins;
+
+  struct fiber fibers[MAX_FIBER_COUNT];
+  struct fiber *fiber;
+  uint8_t fiber_count;
+  struct timers timers;
+
+  uint64_t fuel_limit;
+  struct op *resume_pc;
+  char error[MAX_ERROR_LENGTH];
+};
+
+_Static_assert(offsetof(struct vm, snapshot) == CACHE_LINE_SIZE, "Hot VM fields don't fit in a cache line");
+
+/* Returns a copy of src, or an empty node; NULL once the pool is exhausted. Free nodes are reused first. */
+
+struct node *new_node(struct vm *vm, struct node *src) {
+  struct node *n = vm->free_nodes;
+
+  if (n) {
+    vm->free_nodes = n->children[0];
+    vm->free_node_count--;
+  } else if (vm->node_count == MAX_NODE_COUNT) {
+    return NULL;
+  } else {
+    n = vm->nodes + vm->node_count++;
+  }
+
+  if (src) {
+    *n = *src;
+  } else {
+    memset(n, 0, sizeof(*n));
+  }
+  
+  return n;
+}
+
+struct scope *peek_scope(struct vm *vm);
+struct scope *push_scope(struct vm *vm);
+
+void bool_dump(struct val *val, FILE *out) {
+  fputs(val->as_bool ? "T" : "F", out);
+}
+
+bool bool_equal(struct val *x, struct val *y) {
+  return x->as_bool == y->as_bool;
+}
+
+uint32_t bool_hash(struct val *val) {
+  return val->as_bool;
+}
+
+bool bool_true(struct val *val) {
+  return val->as_bool;
+}
+
+void chan_dump(struct val *val, FILE *out) {
+  fprintf(out, "Chan(%" PRIu32 ")", channel_length(val->as_channel));
+}
+
+bool chan_equal(struct val *x, struct val *y) {
+  return x->as_channel == y->as_channel;
+}
+
+struct dict_dump_state {
+  FILE *out;
+  bool sep;
+};
+
+bool dict_dump_entry(struct map_entry *e, void *data) {
+  struct dict_dump_state *s = data;
+  if (s->sep) { fputc(' ', s->out); }
+  val_dump(&e->key, s->out);
+  fputc(' ', s->out);
+  val_dump(&e->val, s->out);
+  s->sep = true;
+  return true;
+}
+
+void dict_dump(struct val *val, FILE *out) {
+  struct dict_dump_state s = {.out = out, .sep = false};
+  fputs("Dict(", out);
+  dict_each(val->as_dict, dict_dump_entry, &s);
+  fputc(')', out);
+}
+
+bool dict_equal_entry(struct map_entry *e, void *data) {
+  struct val *v = dict_get(data, &e->key);
+  return v && item_equal(&e->val, v);
+}
+
+bool dict_equal(struct val *x, struct val *y) {
+  if (y->type != x->type) { return false; }
+  if (x->as_dict == y->as_dict) { return true; }
+  return node_count(x->as_dict) == node_count(y->as_dict) && dict_each(x->as_dict, dict_equal_entry, y->as_dict);
+}
+
+bool dict_true(struct val *val) {
+  return node_count(val->as_dict);
+}
+
+void func_val_dump(struct val *val, FILE *out) {
+  func_dump(val->as_func, out);
+}
+
+enum emit_res func_val_emit(struct val *val, form_t form, struct form_range *in, struct vm *vm) {
+  for (uint8_t i = 0; i < val->as_func->nargs; i++) {
+    if (form_range_null(in)) {
+      error(vm, form_pos(vm, form), "Missing func arguments: %s %" PRIu8, val->as_func->name, i);
+      return EMIT_ERROR;
+    }
+    
+    form_t f = pop_form(vm, in);
+    enum emit_res res = form_emit(f, in, vm);
+    if (res != EMIT_OK) { return res; }
+  }
+       
+  emit(vm, OP_CALL, form)->as_call.func = val->as_func;
+  return EMIT_OK;
+}
+
+struct val *func_val_lit(struct val *val) {
+  return NULL;
+}
+
+uint8_t func_val_nargs(struct val *val) {
+  return val->as_func->nargs;
+}
+
+void int_dump(struct val *val, FILE *out) {
+  fprintf(out, "%" PRId32, val->as_int);
+}
+
+bool int_equal(struct val *x, struct val *y) {
+  return x->as_int == y->as_int;
+}
+
+uint32_t int_hash(struct val *val) {
+  return (uint32_t)val->as_int * 2654435761u;
+}
+
+bool int_true(struct val *val) {
+  return val->as_int;
+}
+
+void meta_dump(struct val *val, FILE *out) {
+  fputs(val->as_meta->name, out);
+}
+
+/* Quotes are forms used as values, which only have an index to show without their VM. */
+
+void quote_dump(struct val *val, FILE *out) {
+  fprintf(out, "Quote(%" PRIu32 ")", val->as_quote);
+}
+
+bool quote_equal(struct val *x, struct val *y) {
+  return x->as_quote == y->as_quote;
+}
+
+void reg_dump(struct val *val, FILE *out) {
+  fprintf(out, "Reg(%" PRId16 ")", val->as_reg);
+}
+
+enum emit_res reg_emit(struct val *val, form_t form, struct form_range *in, struct vm *vm) {
+  emit(vm, OP_STORE, form)->as_store.reg = val->as_reg;
+  return EMIT_OK;
+}
+
+struct val *reg_lit(struct val *val) {
+  return NULL;
+}
+
+/* Returns the text of a Slice or Str. */
+
+struct slice val_text(struct val *val) {
+  if (val->type == &slice_type) { return *val->as_slice; }
+  return (struct slice){val->as_str, strlen(val->as_str)};
+}
+
+void slice_dump(struct val *val, FILE *out) {
+  fprintf(out, "\"%.*s\"", (int)val->as_slice->length, val->as_slice->start);
+}
+
+/* Slices and Strs are equal when their text is. */
+
+bool slice_equal(struct val *x, struct val *y) {
+  if (y->type != &slice_type && y->type != &str_type) { return false; }
+  struct slice xs = val_text(x), ys = val_text(y);
+  return xs.length == ys.length && memcmp(xs.start, ys.start, xs.length) == 0;
+}
+
+/* FNV-1a like syms, shared by Slices and Strs since they're equal when their text is. */
+
+uint32_t text_hash(struct val *val) {
+  struct slice s = val_text(val);
+  uint32_t h = 2166136261u;
+  for (const char *c = s.start; c < s.start + s.length; c++) { h = (h ^ (uint8_t)*c) * 16777619u; }
+  return h;
+}
+
+bool slice_true(struct val *val) {
+  return val->as_slice->length;
+}
+
+void str_dump(struct val *val, FILE *out) {
+  fprintf(out, "\"%s\"", val->as_str);
+}
+
+bool str_equal(struct val *x, struct val *y) {
+  return (y->type == &str_type) ? strcmp(x->as_str, y->as_str) == 0 : slice_equal(x, y);
+}
+
+bool str_true(struct val *val) {
+  return *val->as_str;
+}
+
+void vec_dump(struct val *val, FILE *out) {
+  fputs("Vec(", out);
+  
+  for (uint32_t i = 0; i < node_count(val->as_vec); i++) {
+    if (i) { fputc(' ', out); }
+    val_dump(vec_get(val->as_vec, i), out);
+  }
+
+  fputc(')', out);
+}
+
+bool vec_equal(struct val *x, struct val *y) {
+  if (y->type != x->type) { return false; }
+  if (x->as_vec == y->as_vec) { return true; }
+  uint32_t n = node_count(x->as_vec);
+  if (n != node_count(y->as_vec)) { return false; }
+
+  for (uint32_t i = 0; i < n; i++) {
+    if (!item_equal(vec_get(x->as_vec, i), vec_get(y->as_vec, i))) { return false; }
+  }
+
+  return true;
+}
+
+bool vec_true(struct val *val) {
+  return node_count(val->as_vec);
+}
+
+void macro_dump(struct val *val, FILE *out);
+enum emit_res macro_emit(struct val *val, form_t form, struct form_range *in, struct vm *vm);
+struct val *macro_lit(struct val *val);
+uint8_t macro_nargs(struct val *val);
+
+struct op *add_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *batch_map_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *bench_call_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *chan_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *debug_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *dict_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *fiber_end_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *fiber_start_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *get_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *length_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *lines_close_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *lines_next_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *lines_open_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *lt_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *pfold_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *push_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *quote_fill_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *recv_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *send_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *set_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *sleep_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *sub_body(struct func *self, struct op *ret_pc, struct vm *vm);
+struct op *vec_body(struct func *self, struct op *ret_pc, struct vm *vm);
+
+enum emit_res bench_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res collect_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res equal_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res filter_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res fold_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res func_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res go_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res if_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res import_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res lines_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res macro_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res map_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res nop_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res pmap_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res preduce_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res quote_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res range_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+enum emit_res sum_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+
+/*** Builtins
+     Builtin types, funcs and macros are initialized at build time and shared by all VMs,
+     which allows clones to use values from their snapshot.
+
+     Lookups fall back to the builtin table once all scopes have been searched, 
+     the table is searched using binary search and has to be kept sorted by strcmp().
+***/
+
+#define TYPE(_name, _tag, ...)						\
+  {.name = _name, .tag = _tag,						\
+   .methods = {.emit = default_emit, .is_true = default_true,		\
+	       .lit = default_lit, .nargs = default_nargs, __VA_ARGS__}}
+
+static struct type bool_type = TYPE("Bool", TAG_BOOL,
+				    .dump = bool_dump, .equal = bool_equal, .hash = bool_hash, .is_true = bool_true);
+
+static struct type chan_type = TYPE("Chan", TAG_CHAN, .dump = chan_dump, .equal = chan_equal);
+static struct type dict_type = TYPE("Dict", TAG_DICT, .dump = dict_dump, .equal = dict_equal, .is_true = dict_true);
+
+static struct type func_type = TYPE("Func", TAG_FUNC,
+				    .dump = func_val_dump, .emit = func_val_emit,
+				    .lit = func_val_lit, .nargs = func_val_nargs);
+
+static struct type int_type = TYPE("Int", TAG_INT,
+				   .dump = int_dump, .equal = int_equal, .hash = int_hash, .is_true = int_true);
+
+static struct type macro_type = TYPE("Macro", TAG_MACRO,
+				     .dump = macro_dump, .emit = macro_emit,
+				     .lit = macro_lit, .nargs = macro_nargs);
+
+static struct type meta_type = TYPE("Meta", TAG_META, .dump = meta_dump);
+static struct type quote_type = TYPE("Quote", TAG_QUOTE, .dump = quote_dump, .equal = quote_equal);
+static struct type reg_type = TYPE("Reg", TAG_REG, .dump = reg_dump, .emit = reg_emit, .lit = reg_lit);
+
+static struct type slice_type = TYPE("Slice", TAG_SLICE,
+				     .dump = slice_dump, .equal = slice_equal, .hash = text_hash, .is_true = slice_true);
+
+static struct type str_type = TYPE("Str", TAG_STR,
+				   .dump = str_dump, .equal = str_equal, .hash = text_hash, .is_true = str_true);
+
+static struct type vec_type = TYPE("Vec", TAG_VEC, .dump = vec_dump, .equal = vec_equal, .is_true = vec_true);
+
+#ifdef USE_SOA
+
+static struct type *const tag_types[] = {
+  NULL, &bool_type, &chan_type, &dict_type, &func_type, &int_type, &macro_type, &meta_type, &quote_type, &reg_type,
+  &slice_type, &str_type, &vec_type
+};
+
+#endif
+
+static struct func add_func = {.name = "+",
+			       .args = {{"x", &int_type}, {"y", &int_type}}, .nargs = 2,
+			       .rets = {&int_type}, .nrets = 1,
+			       .body = add_body};
+
+/* collect calls batch-map with the Vec to append to, the range and the func on top. */
+
+static struct func batch_map_func = {.name = "batch-map", .rets = {&vec_type}, .nrets = 1, .body = batch_map_body};
+
+/* bench calls bench-call with the func on top of its arguments and the number of repetitions. */
+
+static struct func bench_call_func = {.name = "bench-call", .rets = {&int_type}, .nrets = 1, .body = bench_call_body};
+
+static struct func chan_func = {.name = "chan",
+				.args = {{"capacity", &int_type}}, .nargs = 1,
+				.rets = {&chan_type}, .nrets = 1,
+				.body = chan_body};
+
+static struct func debug_func = {.name = "debug", .rets = {&bool_type}, .nrets = 1, .body = debug_body};
+static struct func dict_func = {.name = "dict", .rets = {&dict_type}, .nrets = 1, .body = dict_body};
+
+/* go calls fiber-start with the func on top of its arguments, fiber-end is called once the func returns. */
+
+static struct func fiber_end_func = {.name = "fiber-end", .body = fiber_end_body};
+static struct func fiber_start_func = {.name = "fiber-start", .body = fiber_start_body};
+
+/* get and set take either Vecs indexed by Int or Dicts, which leaves their arguments undeclared. */
+
+static struct func get_func = {.name = "get", .args = {{"coll", NULL}, {"key", NULL}}, .nargs = 2, .body = get_body};
+
+static struct func length_func = {.name = "length",
+				  .args = {{"x", NULL}}, .nargs = 1,
+				  .rets = {&int_type}, .nrets = 1,
+				  .body = length_body};
+
+/* Lines streams call these, they aren't bound since they depend on being called in order. */
+
+static struct func lines_close_func = {.name = "lines-close", .body = lines_close_body};
+
+static struct func lines_next_func = {.name = "lines-next",
+				      .rets = {&slice_type, &bool_type}, .nrets = 2,
+				      .body = lines_next_body};
+
+static struct func lines_open_func = {.name = "lines-open",
+				      .args = {{"path", &str_type}}, .nargs = 1,
+				      .body = lines_open_body};
+
+static struct func lt_func = {.name = "<",
+			      .args = {{"x", &int_type}, {"y", &int_type}}, .nargs = 2,
+			      .rets = {&bool_type}, .nrets = 1,
+			      .body = lt_body};
+
+/* Parallel streams call pfold with the chunk and combining funcs on top of the stack. */
+
+static struct func pfold_func = {.name = "pfold", .body = pfold_body};
+
+/* quote calls quote-fill with a copy of its form where args have been replaced by their registers. */
+
+static struct func push_func = {.name = "push",
+				.args = {{"vec", &vec_type}, {"val", NULL}}, .nargs = 2,
+				.rets = {&vec_type}, .nrets = 1,
+				.body = push_body};
+
+static struct func quote_fill_func = {.name = "quote-fill",
+				      .args = {{"form", &quote_type}}, .nargs = 1,
+				      .rets = {&quote_type}, .nrets = 1,
+				      .body = quote_fill_body};
+
+/* Channels take values of any type, which leaves nothing to declare for the values sent and received. */
+
+static struct func recv_func = {.name = "recv", .args = {{"channel", &chan_type}}, .nargs = 1, .body = recv_body};
+
+static struct func send_func = {.name = "send",
+				.args = {{"channel", &chan_type}, {"val", NULL}}, .nargs = 2,
+				.body = send_body};
+
+static struct func set_func = {.name = "set",
+			       .args = {{"coll", NULL}, {"key", NULL}, {"val", NULL}}, .nargs = 3,
+			       .body = set_body};
+
+static struct func sleep_func = {.name = "sleep", .args = {{"ms", &int_type}}, .nargs = 1, .body = sleep_body};
+
+static struct func sub_func = {.name = "-",
+			       .args = {{"x", &int_type}, {"y", &int_type}}, .nargs = 2,
+			       .rets = {&int_type}, .nrets = 1,
+			       .body = sub_body};
+
+static struct func vec_func = {.name = "vec", .rets = {&vec_type}, .nrets = 1, .body = vec_body};
+
+static struct macro bench_macro = {"bench", 2, 0, bench_body};
+static struct macro collect_macro = {"collect", 1, 0, collect_body};
+static struct macro equal_macro = {"=", 2, 0, equal_body};
+static struct macro filter_macro = {"filter", 2, 0x1, filter_body};
+static struct macro fold_macro = {"fold", 3, 0x1, fold_body};
+static struct macro func_macro = {"func", 4, 0x7, func_body};
+static struct macro go_macro = {"go", 1, 0, go_body};
+static struct macro if_macro = {"if", 3, 0, if_body};
+static struct macro import_macro = {"import", 1, 0x1, import_body};
+static struct macro lines_macro = {"lines", 1, 0, lines_body};
+static struct macro macro_macro = {"macro", 3, 0x3, macro_body};
+static struct macro map_macro = {"map", 2, 0x1, map_body};
+static struct macro nop_macro = {"_", 0, 0, nop_body};
+static struct macro pmap_macro = {"pmap", 2, 0x1, pmap_body};
+static struct macro preduce_macro = {"preduce", 3, 0x1, preduce_body};
+static struct macro quote_macro = {"quote", 1, 0x1, quote_body};
+static struct macro range_macro = {"range", 2, 0, range_body};
+static struct macro sum_macro = {"sum", 1, 0, sum_body};
+
+struct builtin {
+  const char *name;
+  struct val val;
+};
+
+static const struct builtin builtins[] = {
+  {"+", {&func_type, .as_func = &add_func}},
+  {"-", {&func_type, .as_func = &sub_func}},
+  {"<", {&func_type, .as_func = &lt_func}},
+  {"=", {&macro_type, .as_macro = &equal_macro}},
+  {"Bool", {&meta_type, .as_meta = &bool_type}},
+  {"Chan", {&meta_type, .as_meta = &chan_type}},
+  {"Dict", {&meta_type, .as_meta = &dict_type}},
+  {"F", {&bool_type, .as_bool = false}},
+  {"Func", {&meta_type, .as_meta = &func_type}},
+  {"Int", {&meta_type, .as_meta = &int_type}},
+  {"Macro", {&meta_type, .as_meta = &macro_type}},
+  {"Meta", {&meta_type, .as_meta = &meta_type}},
+  {"Quote", {&meta_type, .as_meta = &quote_type}},
+  {"Reg", {&meta_type, .as_meta = &reg_type}},
+  {"Slice", {&meta_type, .as_meta = &slice_type}},
+  {"Str", {&meta_type, .as_meta = &str_type}},
+  {"T", {&bool_type, .as_bool = true}},
+  {"Vec", {&meta_type, .as_meta = &vec_type}},
+  {"_", {&macro_type, .as_macro = &nop_macro}},
+  {"bench", {&macro_type, .as_macro = &bench_macro}},
+  {"chan", {&func_type, .as_func = &chan_func}},
+  {"collect", {&macro_type, .as_macro = &collect_macro}},
+  {"debug", {&func_type, .as_func = &debug_func}},
+  {"dict", {&func_type, .as_func = &dict_func}},
+  {"filter", {&macro_type, .as_macro = &filter_macro}},
+  {"fold", {&macro_type, .as_macro = &fold_macro}},
+  {"func", {&macro_type, .as_macro = &func_macro}},
+  {"get", {&func_type, .as_func = &get_func}},
+  {"go", {&macro_type, .as_macro = &go_macro}},
+  {"if", {&macro_type, .as_macro = &if_macro}},
+  {"import", {&macro_type, .as_macro = &import_macro}},
+  {"length", {&func_type, .as_func = &length_func}},
+  {"lines", {&macro_type, .as_macro = &lines_macro}},
+  {"macro", {&macro_type, .as_macro = &macro_macro}},
+  {"map", {&macro_type, .as_macro = &map_macro}},
+  {"pmap", {&macro_type, .as_macro = &pmap_macro}},
+  {"preduce", {&macro_type, .as_macro = &preduce_macro}},
+  {"push", {&func_type, .as_func = &push_func}},
+  {"quote", {&macro_type, .as_macro = &quote_macro}},
+  {"range", {&macro_type, .as_macro = &range_macro}},
+  {"recv", {&func_type, .as_func = &recv_func}},
+  {"send", {&func_type, .as_func = &send_func}},
+  {"set", {&func_type, .as_func = &set_func}},
+  {"sleep", {&func_type, .as_func = &sleep_func}},
+  {"sum", {&macro_type, .as_macro = &sum_macro}},
+  {"vec", {&func_type, .as_func = &vec_func}}
+};
+
+/* Builtin values are never written through the returned pointer, the table lives in read-only memory. */
+
+struct val *find_builtin(const char *name) {
+  size_t min = 0, max = sizeof(builtins) / sizeof(builtins[0]);
+
+  while (min < max) {
+    size_t i = (min + max) / 2;
+    int res = strcmp(name, builtins[i].name);
+    if (!res) { return (struct val *)&builtins[i].val; }
+    if (res < 0) { max = i; } else { min = i+1; }
+  }
+
+  return NULL;
+}
+
+/* Fuel is burnt by backward jumps and calls, eval() yields when the tank runs dry.
+   A fuel_limit of zero means unlimited, which is as close as makes no difference.
+   Deadlines are checked whenever fuel runs out, which is why it's handed out DEADLINE_FUEL at a time while there is one. */
+
+#define DEADLINE_FUEL 65536
+
+void fill(struct vm *self) {
+  self->fuel = (self->deadline && self->fuel_tank > DEADLINE_FUEL) ? DEADLINE_FUEL : self->fuel_tank;
+  self->fuel_tank -= self->fuel;
+}
+
+void refuel(struct vm *self) {
+  self->fuel_tank = self->fuel_limit ? self->fuel_limit : UINT64_MAX;
+  fill(self);
+}
+
+bool deadline_passed(struct vm *self) {
+  return self->deadline && now_ms() >= self->deadline;
+}
+
+/* Clones start out empty and fall back to their snapshot for bindings, form positions and sources,
+   the snapshot is shared and has to stay frozen for as long as its clones are used. */
+
+struct vm *vm_clone(struct vm *self, struct vm *snapshot) {
+  assert(!snapshot || snapshot->frozen);
+  self->snapshot = snapshot;
+  self->frozen = false;
+  self->scope_count = 0;
+
+  for (struct scope *s = self->scopes, *ps = snapshot ? peek_scope(snapshot) : NULL;
+       s < self->scopes+MAX_SCOPE_COUNT;
+       ps = s, s++) {
+    s->parent_scope = ps;
+  }
+
+  self->func_count = 0;
+  self->macro_count = self->expand_depth = 0;
+  self->module_count = 0;
+  self->def_count = 0;
+  forms_init(&self->forms, snapshot ? snapshot->forms.count : 0);
+  syms_init(&self->syms);
+  pthread_mutex_init(&self->read_lock, NULL);
+  self->source_count = snapshot ? snapshot->source_count : 0;
+  if (snapshot) { memcpy(self->sources, snapshot->sources, sizeof(self->sources[0]) * self->source_count); }
+  self->op_count = 0;
+  self->ops_full = false;
+  self->state = NULL;
+  self->state_count = 0;
+  self->frame_count = 0;
+  self->lines_count = 0;
+  self->channel_count = 0;
+  self->node_count = self->free_node_count = 0;
+  self->free_nodes = NULL;
+  self->pins = NULL;
+  self->fiber = self->fibers;
+  self->fiber->status = FIBER_READY;
+  self->fiber_count = 1;
+  timers_init(&self->timers);
+  self->fuel_limit = 0;
+  self->deadline = 0;
+  refuel(self);
+  self->resume_pc = NULL;
+  *self->error = 0;
+  self->debug = false;
+  push_scope(self);
+  return self;
+}
+
+struct vm *vm_snapshot(struct vm *self) {
+  self->frozen = true;
+  return self;
+}
+
+struct vm *vm_init(struct vm *self) {
+  return vm_clone(self, NULL);
+}
+
+uint16_t new_source(struct vm *vm, const char *name) {
+  assert(vm->source_count < MAX_SOURCE_COUNT && strlen(name) < MAX_POS_SOURCE_LENGTH);
+  strcpy(vm->sources[vm->source_count], name);
+  return vm->source_count++;
+}
+
+/* Set while reading on a pipeline's thread, new forms end up in the pipeline's stage rather than the VM. */
+
+static _Thread_local struct forms *read_stage = NULL;
+
+struct forms *read_target(struct vm *vm) {
+  return read_stage ? read_stage : &vm->forms;
+}
+
+/* Syms are shared by stages and the VM, staged reads intern them under the read lock. */
+
+sym_t read_sym(struct vm *vm, const char *name, size_t length) {
+  if (!read_stage) { return sym(&vm->syms, name, length); }
+  pthread_mutex_lock(&vm->read_lock);
+  sym_t s = sym(&vm->syms, name, length);
+  pthread_mutex_unlock(&vm->read_lock);
+  return s;
+}
+
+/* new_form() and new_id() return FORM_NULL and new_lit() NULL once out of room, forms_full() tells what ran out. */
+
+form_t new_form(struct vm *vm, enum form_type type, struct pos pos) {
+  struct forms *fs = read_target(vm);
+  assert(read_stage || !vm->frozen);
+  if (fs->count == MAX_FORM_COUNT) { return FORM_NULL; }
+  form_t self = fs->count++;
+  fs->types[self] = type;
+  fs->data[self] = 0;
+  fs->ends[self] = self+1;
+  fs->pos[self] = pos;
+  return self;
+}
+
+form_t new_id(struct vm *vm, struct pos pos, const char *name, size_t length) {
+  sym_t s = read_sym(vm, name, length);
+  if (s == SYM_NULL) { return FORM_NULL; }
+  form_t self = new_form(vm, FORM_ID, pos);
+  if (self != FORM_NULL) { read_target(vm)->data[self] = s; }
+  return self;
+}
+
+struct val *new_lit(struct vm *vm, struct pos pos, struct type *type) {
+  struct forms *fs = read_target(vm);
+  if (fs->lit_count == MAX_LIT_COUNT) { return NULL; }
+  form_t self = new_form(vm, FORM_LIT, pos);
+  if (self == FORM_NULL) { return NULL; }
+  fs->data[self] = fs->lit_count++;
+  return val_init(fs->lits + fs->data[self], type);
+}
+
+const char *forms_full(struct vm *vm) {
+  struct forms *fs = read_target(vm);
+  if (fs->count == MAX_FORM_COUNT) { return "Too many forms"; }
+  return (fs->lit_count == MAX_LIT_COUNT) ? "Too many literals" : "Too many syms";
+}
+
+/* Moves the forms in range from a stage to the end of the VM's forms, where they're emitted from. */
+
+bool forms_take(struct vm *vm, struct forms *stage, struct form_range *range) {
+  struct forms *fs = &vm->forms;
+  uint32_t lit_count = 0;
+  
+  for (form_t f = range->start; f < range->end; f++) {
+    if (stage->types[f] == FORM_LIT) { lit_count++; }
+  }
+
+  if (fs->count + (range->end - range->start) > MAX_FORM_COUNT || fs->lit_count + lit_count > MAX_LIT_COUNT) {
+    error(vm, stage->pos[range->start], "%s", (fs->lit_count + lit_count > MAX_LIT_COUNT) ? "Too many literals" : "Too many forms");
+    return false;
+  }
+
+  form_t delta = fs->count - range->start;
+
+  for (form_t f = range->start; f < range->end; f++) {
+    form_t t = fs->count++;
+    fs->types[t] = stage->types[f];
+    fs->ends[t] = stage->ends[f] + delta;
+    fs->pos[t] = stage->pos[f];
+    
+    if (stage->types[f] == FORM_LIT) {
+      fs->lits[fs->lit_count] = stage->lits[stage->data[f]];
+      fs->data[t] = fs->lit_count++;
+    } else {
+      fs->data[t] = stage->data[f];
+    }
+  }
+
+  form_range_init(range, range->start + delta, range->end + delta);
+  return true;
+}
+
+enum form_type form_type(struct vm *vm, form_t form) {
+  return vm->forms.types[form];
+}
+
+const char *form_id(struct vm *vm, form_t form) {
+  assert(vm->forms.types[form] == FORM_ID);
+  return sym_name(&vm->syms, vm->forms.data[form]);
+}
+
+struct val *form_lit(struct vm *vm, form_t form) {
+  assert(vm->forms.types[form] == FORM_LIT);
+  return vm->forms.lits + vm->forms.data[form];
+}
+
+struct pos form_pos(struct vm *vm, form_t form) {
+  while (form < vm->forms.start) { vm = vm->snapshot; }
+  return vm->forms.pos[form];
+}
+
+struct form_range form_items(struct vm *vm, form_t form) {
+  struct form_range items;
+  form_range_init(&items, form+1, vm->forms.ends[form]);
+  return items;
+}
+
+form_t pop_form(struct vm *vm, struct form_range *in) {
+  assert(!form_range_null(in));
+  form_t f = in->start;
+  in->start = vm->forms.ends[f];
+  return f;
+}
+
+void val_dump(struct val *self, FILE *out) {
+  assert(self->type->methods.dump);
+  self->type->methods.dump(self, out);
+}
+
+enum emit_res val_emit(struct val *self, form_t form, struct form_range *in, struct vm *vm) {
+  assert(self->type->methods.emit);
+  return self->type->methods.emit(self, form, in, vm);
+}
+
+bool val_equal(struct val *self, struct val *other) {
+  assert(self->type->methods.equal);
+  return self->type->methods.equal(self, other);
+}
+
+bool val_true(struct val *self) {
+  assert(self->type->methods.is_true);
+  return self->type->methods.is_true(self);
+}
+
+struct val *val_lit(struct val *self) {
+  assert(self->type->methods.lit);
+  return self->type->methods.lit(self);
+}
+
+#ifdef USE_SOA
+
+_Static_assert(sizeof(slot_t) == sizeof(struct val) - offsetof(struct val, as_bool), "Slot size mismatch");
+
+struct state *state_init(struct state *self) {
+  memset(self->reg_tags, 0, sizeof(self->reg_tags));
+  self->stack_size = 0;
+  return self;
+}
+
+struct val slot_val(slot_t *slot, uint8_t tag) {
+  struct val v;
+  v.type = tag_types[tag];
+  memcpy(&v.as_bool, slot, sizeof(slot_t));
+  return v;
+}
+
+slot_t *slot_init(struct state *self, uint8_t i, struct type *type) {
+  self->stack_tags[i] = type->tag;
+  return self->stack+i;
+}
+
+struct val stack_get(struct state *self, uint8_t i) {
+  return slot_val(self->stack+i, self->stack_tags[i]);
+}
+
+void stack_set(struct state *self, uint8_t i, struct val val) {
+  self->stack_tags[i] = val.type ? val.type->tag : TAG_NULL;
+  memcpy(self->stack+i, &val.as_bool, sizeof(slot_t));
+}
+
+struct val reg_get(struct state *self, reg_t reg) {
+  return slot_val(self->regs+reg, self->reg_tags[reg]);
+}
+
+void state_load(struct state *self, reg_t reg) {
+  uint8_t i = --self->stack_size;
+  self->regs[reg] = self->stack[i];
+  self->reg_tags[reg] = self->stack_tags[i];
+}
+
+void state_store(struct state *self, reg_t reg) {
+  uint8_t i = self->stack_size++;
+  self->stack[i] = self->regs[reg];
+  self->stack_tags[i] = self->reg_tags[reg];
+}
+
+/* Moves the top n values of from's stack to the top of to's stack, 
+   n is mostly 1 or 2 which makes a loop faster than calling memcpy(). */
+
+void stack_move(struct state *from, struct state *to, uint8_t n) {
+  from->stack_size -= n;
+  
+  for (uint8_t i = 0; i < n; i++) {
+    to->stack[to->stack_size] = from->stack[from->stack_size+i];
+    to->stack_tags[to->stack_size++] = from->stack_tags[from->stack_size+i];
+  }
+}
+
+/* Moves the top n values of from's stack to the first n registers of to. */
+
+void stack_to_regs(struct state *from, struct state *to, uint8_t n) {
+  from->stack_size -= n;
+
+  for (uint8_t i = 0; i < n; i++) {
+    to->regs[i] = from->stack[from->stack_size+i];
+    to->reg_tags[i] = from->stack_tags[from->stack_size+i];
+  }
+}
+
+#else
+
+struct state *state_init(struct state *self) {
+  memset(self->regs, 0, sizeof(self->regs));
+  self->stack_size = 0;
+  return self;
+}
+
+slot_t *slot_init(struct state *self, uint8_t i, struct type *type) {
+  return val_init(self->stack+i, type);
+}
+
+struct val stack_get(struct state *self, uint8_t i) {
+  return self->stack[i];
+}
+
+void stack_set(struct state *self, uint8_t i, struct val val) {
+  self->stack[i] = val;
+}
+
+struct val reg_get(struct state *self, reg_t reg) {
+  return self->regs[reg];
+}
+
+void state_load(struct state *self, reg_t reg) {
+  self->regs[reg] = self->stack[--self->stack_size];
+}
+
+void state_store(struct state *self, reg_t reg) {
+  self->stack[self->stack_size++] = self->regs[reg];
+}
+
+/* Moves the top n values of from's stack to the top of to's stack, 
+   n is mostly 1 or 2 which makes a loop faster than calling memcpy(). */
+
+void stack_move(struct state *from, struct state *to, uint8_t n) {
+  from->stack_size -= n;
+  for (uint8_t i = 0; i < n; i++) { to->stack[to->stack_size++] = from->stack[from->stack_size+i]; }
+}
+
+/* Moves the top n values of from's stack to the first n registers of to. */
+
+void stack_to_regs(struct state *from, struct state *to, uint8_t n) {
+  from->stack_size -= n;
+  for (uint8_t i = 0; i < n; i++) { to->regs[i] = from->stack[from->stack_size+i]; }
+}
+
+#endif
+
+struct frame *frame_init(struct frame *self, struct func *func, struct op *ret_pc) {
+  self->func = func;
+  self->ret_pc = ret_pc;
+  return self;
+}
+
+void format_error(char *out, struct vm *vm, struct pos pos, const char *fmt, va_list args) {
+  int n = snprintf(out, MAX_ERROR_LENGTH,
+		   "Error in %s, line %" PRIu16 " column %" PRIu16 ": ",
+		   vm->sources[pos.source], pos.line, pos.column);
+  
+  assert(vsnprintf(out+n, MAX_ERROR_LENGTH-n, fmt, args) > 0);
+}
+
+void verror(struct vm *vm, struct pos pos, const char *fmt, va_list args) {
+  format_error(emit_section ? emit_section->error : vm->error, vm, pos, fmt, args);
+}
+
+void error(struct vm *vm, struct pos pos, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  verror(vm, pos, fmt, args);
+  va_end(args);
+}
+
+struct scope *scope_init(struct scope *self, struct vm *vm);
+
+/* Returns NULL once MAX_SCOPE_COUNT scopes are open. */
+
+struct scope *push_scope(struct vm *vm) {
+  assert(!emit_section);
+  if (vm->scope_count == MAX_SCOPE_COUNT) { return NULL; }
+  return scope_init(vm->scopes+vm->scope_count++, vm);
+}
+
+struct scope *peek_scope(struct vm *vm) {
+  if (emit_section) { return &emit_section->scope; }
+  assert(vm->scope_count);
   return vm->scopes+vm->scope_count-1;
 }
 
-struct val *bind(struct vm *vm, const char *name) {
-  return env_set(&peek_scope(vm)->bindings, name);
+struct scope *pop_scope(struct vm *vm) {
+  assert(vm->scope_count);
+  return vm->scopes + --vm->scope_count;
+}
+
+struct val *bind_id(struct vm *vm, const char *name) {
+  assert(!vm->frozen);
+  return env_set(&peek_scope(vm)->bindings, name);
+}
+
+struct val *find(struct vm *vm, const char *name) {
+  for (struct scope *s = peek_scope(vm); s; s = s->parent_scope) {
+    struct val *v = env_get(&s->bindings, name);
+    if (v) { return v; }
+  }
+
+  return find_builtin(name);
+}
+
+struct state *push_state(struct vm *vm) {
+  assert(vm->state_count < MAX_STATE_COUNT);
+  return state_init(vm->state = vm->states + vm->state_count++);
+}
+			 
+struct state *peek_state(struct vm *vm) {
+  assert(vm->state);
+  return vm->state;
+}
+
+struct state *pop_state(struct vm *vm) {
+  assert(vm->state_count);
+  struct state *s = vm->state;
+  vm->state = --vm->state_count ? s-1 : NULL;
+  return s;
+}
+
+/* Returns NULL once MAX_STATE_COUNT states or MAX_FRAME_COUNT frames are in use. */
+
+struct frame *push_frame(struct vm *vm, struct func *func, struct op *ret_pc) {
+  if (vm->state_count == MAX_STATE_COUNT || vm->frame_count == MAX_FRAME_COUNT) { return NULL; }
+  push_state(vm);
+  return frame_init(vm->frames+vm->frame_count++, func, ret_pc);
+}
+			 
+struct frame *peek_frame(struct vm *vm) {
+  assert(vm->frame_count);
+  return vm->frames+vm->frame_count-1;
+}
+
+struct frame *pop_frame(struct vm *vm) {
+  assert(vm->frame_count);
+  pop_state(vm);
+  return vm->frames + --vm->frame_count;
+}
+
+/*** Node Collection
+     Nodes are collected by marking everything reachable from the VM and sweeping unmarked nodes into the free list.
+     Only nodes from the VM's own pool are marked and freed, snapshots never point into the pools of their clones.
+     Collecting only happens when an update reserves nodes up front, 
+     which keeps nodes from going away under an update that's in progress.
+***/
+
+#define NODE_RESERVE 32
+
+/* Pins keep values that are only referenced from C reachable. */
+
+struct pin {
+  struct val *vals;
+  uint32_t count;
+  struct pin *prev;
+};
+
+struct pin *pin_init(struct pin *self, struct vm *vm, struct val *vals, uint32_t count) {
+  self->vals = vals;
+  self->count = count;
+  self->prev = vm->pins;
+  vm->pins = self;
+  return self;
+}
+
+void unpin(struct vm *vm, struct pin *pin) {
+  vm->pins = pin->prev;
+}
+
+bool own_node(struct vm *vm, struct node *node) {
+  return node >= vm->nodes && node < vm->nodes + MAX_NODE_COUNT;
+}
+
+void val_mark(struct vm *vm, struct val *val);
+
+void node_mark(struct vm *vm, struct node *self, bool dict) {
+  if (!self || !own_node(vm, self) || self->marked) { return; }
+  self->marked = true;
+
+  if (dict) {
+    for (uint8_t i = 0; i < MAP_WIDTH; i++) {
+      if (!(self->used & (1 << i))) { continue; }
+      struct map_entry *e = self->entries + i;
+      
+      if (self->branches & (1 << i)) {
+	node_mark(vm, e->val.as_dict, true);
+      } else {
+	val_mark(vm, &e->key);
+	val_mark(vm, &e->val);
+      }
+    }
+  } else {
+    for (uint8_t i = 0; i < NODE_WIDTH; i++) {
+      if (self->shift) {
+	node_mark(vm, self->children[i], false);
+      } else {
+	val_mark(vm, self->items + i);
+      }
+    }
+  }
+}
+
+void val_mark(struct vm *vm, struct val *val) {
+  if (val->type == &vec_type) {
+    node_mark(vm, val->as_vec, false);
+  } else if (val->type == &dict_type) {
+    node_mark(vm, val->as_dict, true);
+  }
+}
+
+void env_mark(struct vm *vm, struct env *env) {
+  for (struct env_item *it = env->items; it < env->items + env->item_count; it++) { val_mark(vm, &it->val); }
+}
+
+void state_mark(struct vm *vm, struct state *state) {
+  for (uint8_t i = 0; i < state->stack_size; i++) {
+    struct val v = stack_get(state, i);
+    val_mark(vm, &v);
+  }
+
+  for (reg_t i = 0; i < MAX_REG_COUNT; i++) {
+    struct val v = reg_get(state, i);
+    if (v.type) { val_mark(vm, &v); }
+  }
+}
+
+/* Roots are values that aren't reachable from the VM, such as the ones being updated. */
+
+void node_collect(struct vm *vm, struct val *roots, uint8_t root_count) {
+  for (uint8_t i = 0; i < root_count; i++) { val_mark(vm, roots+i); }
+
+  for (struct pin *p = vm->pins; p; p = p->prev) {
+    for (uint32_t i = 0; i < p->count; i++) { val_mark(vm, p->vals+i); }
+  }
+  
+  for (struct state *s = vm->states; s < vm->states + vm->state_count; s++) { state_mark(vm, s); }
+
+  for (struct fiber *f = vm->fibers; f < vm->fibers + vm->fiber_count; f++) {
+    if (f == vm->fiber || f->status == FIBER_DONE) { continue; }
+    for (struct state *s = f->states; s < f->states + f->state_count; s++) { state_mark(vm, s); }
+  }
+
+  for (struct channel *c = vm->channels; c < vm->channels + vm->channel_count; c++) {
+    for (uint32_t i = c->head; i != c->tail; i++) { val_mark(vm, c->items + i % MAX_CHANNEL_LENGTH); }
+  }
+
+  for (struct op *op = vm->ops; op < vm->ops + vm->op_count; op++) {
+    if (op->code == OP_PUSH) {
+      val_mark(vm, &op->as_push.val);
+    } else if (op->code == OP_EQUAL) {
+      val_mark(vm, &op->as_equal.x);
+      val_mark(vm, &op->as_equal.y);
+    }
+  }
+
+  for (struct val *v = vm->forms.lits; v < vm->forms.lits + vm->forms.lit_count; v++) { val_mark(vm, v); }
+  for (struct scope *s = vm->scopes; s < vm->scopes + vm->scope_count; s++) { env_mark(vm, &s->bindings); }
+  for (struct module *m = vm->modules; m < vm->modules + vm->module_count; m++) { env_mark(vm, &m->exports); }
+
+  vm->free_nodes = NULL;
+  vm->free_node_count = 0;
+  
+  for (struct node *n = vm->nodes + vm->node_count; n-- > vm->nodes;) {
+    if (n->marked) {
+      n->marked = false;
+    } else {
+      n->children[0] = vm->free_nodes;
+      vm->free_nodes = n;
+      vm->free_node_count++;
+    }
+  }
+}
+
+uint32_t node_room(struct vm *vm) {
+  return vm->free_node_count + MAX_NODE_COUNT - vm->node_count;
+}
+
+/* Makes sure there are at least count nodes left, collecting if needed;
+   updates reserve NODE_RESERVE nodes before they start, which is more than any single update needs. */
+
+bool node_reserve(struct vm *vm, uint32_t count, struct val *roots, uint8_t root_count) {
+  if (node_room(vm) >= count) { return true; }
+  node_collect(vm, roots, root_count);
+  return node_room(vm) >= count;
+}
+
+/* Counts the nodes that adopting node from src would copy. */
+
+uint32_t val_size(struct vm *src, struct val *val);
+
+uint32_t node_size(struct vm *src, struct node *node, bool dict) {
+  if (!node || !own_node(src, node)) { return 0; }
+  uint32_t n = 1;
+
+  if (dict) {
+    for (uint8_t i = 0; i < MAP_WIDTH; i++) {
+      if (!(node->used & (1 << i))) { continue; }
+      struct map_entry *e = node->entries + i;
+
+      if (node->branches & (1 << i)) {
+	n += node_size(src, e->val.as_dict, true);
+      } else {
+	n += val_size(src, &e->key) + val_size(src, &e->val);
+      }
+    }
+  } else {
+    for (uint8_t i = 0; i < NODE_WIDTH; i++) {
+      n += node->shift ? node_size(src, node->children[i], false) : val_size(src, node->items + i);
+    }
+  }
+  
+  return n;
+}
+
+uint32_t val_size(struct vm *src, struct val *val) {
+  if (val->type == &vec_type) { return node_size(src, val->as_vec, false); }
+  if (val->type == &dict_type) { return node_size(src, val->as_dict, true); }
+  return 0;
+}
+
+/* Copies the nodes of val that live in src's pool into the VM's, which is how values leave workers;
+   room has to be reserved up front using val_size(). */
+
+void val_adopt(struct vm *vm, struct vm *src, struct val *val);
+
+struct node *node_adopt(struct vm *vm, struct vm *src, struct node *node, bool dict) {
+  if (!node || !own_node(src, node)) { return node; }
+  struct node *self = new_node(vm, node);
+  assert(self);
+  
+  if (dict) {
+    for (uint8_t i = 0; i < MAP_WIDTH; i++) {
+      if (!(self->used & (1 << i))) { continue; }
+      struct map_entry *e = self->entries + i;
+
+      if (self->branches & (1 << i)) {
+	e->val.as_dict = node_adopt(vm, src, e->val.as_dict, true);
+      } else {
+	val_adopt(vm, src, &e->key);
+	val_adopt(vm, src, &e->val);
+      }
+    }
+  } else {
+    for (uint8_t i = 0; i < NODE_WIDTH; i++) {
+      if (self->shift) {
+	self->children[i] = node_adopt(vm, src, self->children[i], false);
+      } else {
+	val_adopt(vm, src, self->items + i);
+      }
+    }
+  }
+
+  return self;
+}
+
+void val_adopt(struct vm *vm, struct vm *src, struct val *val) {
+  if (val->type == &vec_type) {
+    val->as_vec = node_adopt(vm, src, val->as_vec, false);
+  } else if (val->type == &dict_type) {
+    val->as_dict = node_adopt(vm, src, val->as_dict, true);
+  }
+}
+
+/* Set from signal handlers to abort evaluation. */
+
+static volatile sig_atomic_t interrupted = 0;
+
+void interrupt(int signal) {
+  interrupted = 1;
+}
+
+/* Copies the running fiber's states and frames out of the VM, to be resumed from pc. */
+
+bool fiber_save(struct vm *vm, struct op *pc, struct pos pos) {
+  struct fiber *f = vm->fiber;
+  
+  if (vm->state_count > MAX_FIBER_DEPTH) {
+    error(vm, pos, "Too deep to wait: %" PRIu32, vm->state_count);
+    return false;
+  }
+
+  memcpy(f->states, vm->states, vm->state_count * sizeof(struct state));
+  f->state_count = vm->state_count;
+  memcpy(f->frames, vm->frames, vm->frame_count * sizeof(struct frame));
+  f->frame_count = vm->frame_count;
+  f->pc = pc;
+  return true;
+}
+
+void fiber_load(struct vm *vm, struct fiber *f) {
+  memcpy(vm->states, f->states, f->state_count * sizeof(struct state));
+  vm->state_count = f->state_count;
+  vm->state = f->state_count ? vm->states + f->state_count - 1 : NULL;
+  memcpy(vm->frames, f->frames, f->frame_count * sizeof(struct frame));
+  vm->frame_count = f->frame_count;
+  vm->fiber = f;
+}
+
+/* Wakes fibers whose timers have expired. */
+
+void fiber_tick(struct vm *vm) {
+  struct ls expired;
+  ls_init(&expired);
+  timers_advance(&vm->timers, now_ms(), &expired);
+
+  LS_DO(&expired, t) {
+    BASEOF(t, struct fiber, timer.ls)->status = FIBER_READY;
+  }
+}
+
+/* Loads the next ready fiber after the running one and returns its pc, sleeping until one wakes up if needed;
+   running out of fibers to wake means they're all waiting for each other. */
+
+struct op *fiber_switch(struct vm *vm, struct pos pos) {
+  for (;;) {
+    fiber_tick(vm);
+    struct fiber *f = vm->fiber;
+    
+    for (uint8_t i = 0; i < vm->fiber_count; i++) {
+      if (++f == vm->fibers + vm->fiber_count) { f = vm->fibers; }
+      
+      if (f->status == FIBER_READY) {
+	fiber_load(vm, f);
+	return f->pc;
+      }
+    }
+    
+    if (!vm->timers.count) {
+      error(vm, pos, "Deadlock");
+      return NULL;
+    }
+
+    if (deadline_passed(vm)) {
+      error(vm, pos, "Deadline exceeded");
+      return NULL;
+    }
+
+    uint64_t until = timers_next(&vm->timers);
+    if (vm->deadline && vm->deadline < until) { until = vm->deadline; }
+    struct timespec ts = {.tv_sec = until / 1000, .tv_nsec = until % 1000 * 1000000};
+    
+    if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && interrupted) {
+      interrupted = 0;
+      error(vm, pos, "Interrupted");
+      return NULL;
+    }
+  }
+}
+
+/* Saves the running fiber and switches, the CALL before ret_pc is retried once the channel wakes it. */
+
+struct op *fiber_wait(struct vm *vm, struct channel *channel, struct op *ret_pc) {
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+  if (!fiber_save(vm, ret_pc-1, pos)) { return NULL; }
+  vm->fiber->status = FIBER_WAITING;
+  vm->fiber->channel = channel;
+  return fiber_switch(vm, pos);
+}
+
+void fiber_wake(struct vm *vm, struct channel *channel) {
+  for (struct fiber *f = vm->fibers; f < vm->fibers + vm->fiber_count; f++) {
+    if (f->status == FIBER_WAITING && f->channel == channel) { f->status = FIBER_READY; }
+  }
+}
+
+/* Ends all fibers but the first, which is where evaluation started. */
+
+void fiber_reset(struct vm *vm) {
+  for (struct fiber *f = vm->fibers; f < vm->fibers + vm->fiber_count; f++) {
+    if (f->status == FIBER_SLEEPING) { timers_remove(&vm->timers, &f->timer); }
+  }
+  
+  if (vm->fiber != vm->fibers) { fiber_load(vm, vm->fibers); }
+  vm->fiber->status = FIBER_READY;
+  vm->fiber_count = 1;
+}
+
+/* Emitting past MAX_OP_COUNT sets ops_full and hands out a scratch op, which leaves callers free to fill it in;
+   running out is reported by whoever checks emit_full() once they're done emitting. */
+
+static _Thread_local struct op emit_scratch;
+
+struct op *emit(struct vm *vm, enum op_code code, form_t form) {
+  if (emit_section) {
+    if (emit_section->op_count == MAX_OP_COUNT) {
+      emit_section->ops_full = true;
+      return op_init(&emit_scratch, code, form);
+    }
+    
+    return op_init(emit_section->ops + emit_section->op_count++, code, form);
+  }
+  
+  assert(!vm->frozen);
+
+  if (vm->op_count == MAX_OP_COUNT) {
+    vm->ops_full = true;
+    return op_init(&emit_scratch, code, form);
+  }
+  
+  return op_init(vm->ops + vm->op_count++, code, form);
+}
+
+bool emit_full(struct vm *vm, form_t form) {
+  if (!(emit_section ? emit_section->ops_full : vm->ops_full)) { return false; }
+  error(vm, form_pos(vm, form), "Too many ops");
+  return true;
+}
+
+struct op *pc(struct vm *vm) {
+  return emit_section ? emit_section->ops + emit_section->op_count : vm->ops + vm->op_count;
+}
+
+void push(struct vm *vm, struct val val) {
+  struct state *s = peek_state(vm);
+  stack_set(s, s->stack_size++, val);
+}
+
+slot_t *push_init(struct vm *vm, struct type *type) {
+  struct state *s = peek_state(vm);
+  return slot_init(s, s->stack_size++, type);
+}
+
+slot_t *peek(struct vm *vm) {
+  struct state *s = peek_state(vm);
+  assert(s->stack_size);
+  return s->stack+s->stack_size-1;
+}
+
+/* Changes the type of the top value and returns its slot. */
+
+slot_t *peek_init(struct vm *vm, struct type *type) {
+  struct state *s = peek_state(vm);
+  assert(s->stack_size);
+  return slot_init(s, s->stack_size-1, type);
+}
+
+struct val pop(struct vm *vm) {
+  struct state *s = peek_state(vm);
+  assert(s->stack_size);
+  return stack_get(s, --s->stack_size);
+}
+
+/* Pops the top value without looking at its type, the slot stays valid until the next push. */
+
+slot_t *pop_slot(struct vm *vm) {
+  struct state *s = peek_state(vm);
+  assert(s->stack_size);
+  return s->stack + --s->stack_size;
+}
+
+void dump_stack(struct vm *vm, FILE *out) {
+  fputc('[', out);
+  struct state *s = peek_state(vm);
+  
+  for (uint8_t i = 0; i < s->stack_size; i++) {
+    if (i) { fputc(' ', out); }
+    struct val v = stack_get(s, i);
+    val_dump(&v, out);
+  }
+
+  fputc(']', out);
+}
+
+struct scope *scope_init(struct scope *self, struct vm *vm) {
+  env_init(&self->bindings);
+  self->reg_count = self->parent_scope ? self->parent_scope->reg_count : 0;
+  return self;
+}
+
+#define DISPATCH(next_op)					\
+  op = next_op;							\
+  if (vm->debug) { op_dump(op, stdout); fputc('\n', stdout); }	\
+  goto *dispatch[op->code]
+
+/* Saves the pc to resume from and returns to the host with a full tank. */
+
+#define YIELD(pc)					\
+  vm->resume_pc = pc;					\
+  refuel(vm);						\
+  PROBE(eval_end, EVAL_YIELD, vm->frame_count);		\
+  return EVAL_YIELD
+
+/* Errors end all fibers, unwind all frames and close open lines, which leaves the VM ready for the next evaluation. */
+
+#define FAIL()							\
+  PROBE(eval_end, EVAL_ERROR, vm->frame_count);			\
+  fiber_reset(vm);						\
+  while (vm->frame_count) { pop_frame(vm); }			\
+  while (vm->lines_count) { lines_close(vm->lines + --vm->lines_count); }	\
+  return EVAL_ERROR
+
+/* Ops that push check for room first, calls check that there's room left for their results. */
+
+#define ROOM(n)								\
+  if (peek_state(vm)->stack_size + (n) > MAX_STACK_SIZE) {		\
+    error(vm, form_pos(vm, op->form), "Stack overflow");		\
+    FAIL();								\
+  }
+
+/* Fuel and interrupts are checked at calls and backward jumps only, which is enough to catch any loop. */
+
+#define BURN(pc)							\
+  if (interrupted) {							\
+    interrupted = 0;							\
+    error(vm, form_pos(vm, op->form), "Interrupted");			\
+    FAIL();								\
+  }									\
+									\
+  if (!--vm->fuel) {							\
+    if (deadline_passed(vm)) {						\
+      error(vm, form_pos(vm, op->form), "Deadline exceeded");		\
+      FAIL();								\
+    }									\
+									\
+    if (!vm->fuel_tank) { YIELD(pc); }					\
+    fill(vm);								\
+  }
+
+bool check_rets(struct vm *vm, struct func *func, form_t form) {
+  struct state *s = peek_state(vm);
+  
+  for (uint8_t i = 0; i < func->nrets; i++) {
+    struct type *t = func->rets[i];
+    struct val v = stack_get(s, s->stack_size - func->nrets + i);
+
+    if (t && v.type != t) {
+      error(vm, form_pos(vm, form), "Invalid return value: %s %s", func->name, v.type->name);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+enum eval_res eval(struct vm *vm, struct op *start_pc) {
+  static const void* dispatch[] = {
+    &&BRANCH, &&CALL, &&DROP, &&EQUAL, &&JUMP, &&LOAD, &&NOP, &&PUSH, &&RET, &&STORE,
+    //---STOP---
+    &&STOP};
+
+  PROBE(eval_start, start_pc - vm->ops, vm->frame_count);
+  struct op *op = start_pc;
+  DISPATCH(op);
+
+ BRANCH: {
+    struct op_branch *branch = &op->as_branch;
+    struct val x = pop(vm);
+    DISPATCH(val_true(&x) ? op+1 : branch->false_pc);
+  }
+
+ CALL: {
+    struct op_call *call = &op->as_call;
+    BURN(op);
+    if (call->func->nrets > call->func->nargs) { ROOM(call->func->nrets - call->func->nargs); }
+    PROBE(call, call->func->name, vm->frame_count);
+    struct op *next_pc = call->func->body(call->func, op+1, vm);
+    if (!next_pc) { FAIL(); }
+    DISPATCH(next_pc);
+  }
+  
+ DROP: {
+    struct op_drop *drop = &op->as_drop;
+    struct state *state = peek_state(vm);
+    if (state->stack_size < drop->count) {
+      error(vm, form_pos(vm, op->form), "Not enough values");
+      FAIL();
+    }
+    
+    state->stack_size -= drop->count; 
+    DISPATCH(op+1);
+  }
+  
+ EQUAL: {
+    struct op_equal *equal = &op->as_equal;
+    struct val x = equal->x, y = equal->y;
+    if (x.type && y.type) { ROOM(1); }
+    if (!y.type) { y = pop(vm); }
+    if (!x.type) { x = pop(vm); }
+    push_init(vm, &bool_type)->as_bool = val_equal(&x, &y);
+    DISPATCH(op+1);
+  }
+
+ JUMP: {
+    struct op_jump *jump = &op->as_jump;
+    if (jump->pc <= op) { BURN(jump->pc); }
+    DISPATCH(jump->pc);
+  }
+
+ LOAD: {
+    struct state *state = peek_state(vm);
+    assert(state->stack_size && op->as_load.reg < MAX_REG_COUNT);
+    state_load(state, op->as_load.reg);
+    DISPATCH(op+1);
+  }
+
+ NOP: {
+    while ((op+1)->code == OP_NOP) { op++; }
+    DISPATCH(op);
+  }
+  
+ PUSH: {
+    ROOM(1);
+    push(vm, op->as_push.val);
+    DISPATCH(op+1);
+  }
+
+ RET: {
+    struct func *func = op->as_ret.func;
+    PROBE(ret, func->name, vm->frame_count);
+    struct state *callee = peek_state(vm);
+
+    if (callee->stack_size < func->nrets) {
+      error(vm, form_pos(vm, op->form), "Missing return values: %s", func->name);
+      FAIL();
+    }
+    
+    if (op->as_ret.check && !check_rets(vm, func, op->form)) { FAIL(); }
+    struct frame *f = pop_frame(vm);
+    stack_move(callee, peek_state(vm), func->nrets);
+    
+    DISPATCH(f->ret_pc);
+  }
+  
+ STORE: {
+    ROOM(1);
+    struct state *state = peek_state(vm);
+    assert(op->as_store.reg < MAX_REG_COUNT);
+    state_store(state, op->as_store.reg);
+    DISPATCH(op+1);    
+  }
+  
+ STOP: {}
+
+  PROBE(eval_end, EVAL_OK, vm->frame_count);
+  return EVAL_OK;
+}
+
+/* Calls func with its arguments on the stack and evaluates until it returns, yields are resumed right away.
+   The call is evaluated as an op of its own, since bodies look up their form in the op before ret_pc. */
+
+enum eval_res eval_call(struct vm *vm, struct func *func, form_t form) {
+  struct op ops[2];
+  op_init(ops, OP_CALL, form)->as_call.func = func;
+  op_init(ops+1, OP_STOP, form);
+  enum eval_res res = eval(vm, ops);
+  while (res == EVAL_YIELD) { res = eval(vm, vm->resume_pc); }
+  return res;
+}
+
+/*** Batches
+     Batches evaluate a func over many tuples of Int arguments, 
+     vectorizable funcs are evaluated LANE_COUNT tuples at a time using GCC vector extensions.
+
+     Lanes step through the func's own ops from start_pc to RET in lockstep, masking out lanes that are elsewhere.
+     Branches that split lanes park the false lanes, and evaluation continues with the lowest pc,
+     which joins them again where the branches meet.
+
+     Funcs that call anything but + and -, or push anything but Ints, are evaluated one tuple at a time.
+     Build with -mavx2 to get a single instruction per vector op.
+***/
+
+#define LANE_COUNT 8
+
+typedef int_t lanes_t __attribute__ ((vector_size (LANE_COUNT * sizeof(int_t))));
+
+struct lanes {
+  lanes_t regs[MAX_REG_COUNT];
+  lanes_t stack[MAX_STACK_SIZE];
+  uint8_t stack_size[LANE_COUNT];
+  struct op *pc[LANE_COUNT];
+};
+
+/* Returns the func's RET if every op up to it is supported, NULL otherwise. */
+
+struct op *vector_end(struct func *func) {
+  if (!func->start_pc) { return NULL; }
+  struct op *max_pc = func->start_pc;
+  
+  for (struct op *op = func->start_pc;; op++) {
+    switch (op->code) {
+    case OP_BRANCH:
+      if (op->as_branch.false_pc < func->start_pc) { return NULL; }
+      if (op->as_branch.false_pc > max_pc) { max_pc = op->as_branch.false_pc; }
+      break;
+    case OP_CALL:
+      if (op->as_call.func != &add_func && op->as_call.func != &sub_func) { return NULL; }
+      break;
+    case OP_EQUAL: {
+      struct op_equal *e = &op->as_equal;
+      if ((e->x.type && e->x.type != &int_type) || (e->y.type && e->y.type != &int_type)) { return NULL; }
+      break;
+    }
+    case OP_JUMP:
+      if (op->as_jump.pc < func->start_pc) { return NULL; }
+      if (op->as_jump.pc > max_pc) { max_pc = op->as_jump.pc; }
+      break;
+    case OP_PUSH:
+      if (op->as_push.val.type != &int_type) { return NULL; }
+      break;
+    case OP_RET:
+      return (op->as_ret.func == func && max_pc <= op) ? op : NULL;
+    case OP_STOP:
+      return NULL;
+    case OP_DROP:
+    case OP_LOAD:
+    case OP_NOP:
+    case OP_STORE:
+      break;
+    }
+  }
+}
+
+/* Picks x in lanes where mask is set and y elsewhere, a macro since vector returns change the ABI without AVX. */
+
+#define BLEND(mask, x, y)			\
+  (((x) & (mask)) | ((y) & ~(mask)))
+
+/* Evaluates up to LANE_COUNT tuples starting at args, Bools are represented as -1/0 in lanes.
+   The group of lanes at the current pc share stack size, lanes are only tracked one by one while groups are split. */
+
+enum eval_res eval_lanes(struct vm *vm, struct func *func, const int_t *args, int_t *rets, uint8_t count) {
+  struct lanes ls;
+  memset(ls.regs, 0, sizeof(ls.regs));
+  lanes_t mask = {0};
+  
+  for (uint8_t l = 0; l < LANE_COUNT; l++) {
+    ls.pc[l] = (l < count) ? func->start_pc : NULL;
+    if (l < count) { mask[l] = -1; }
+  }
+
+  for (uint8_t i = 0; i < func->nargs; i++) {
+    for (uint8_t l = 0; l < count; l++) {
+      ls.regs[i][l] = args[l*func->nargs + i];
+    }
+  }
+
+  struct op *op = func->start_pc;
+  uint8_t sp = 0;
+  bool split = false;
+  
+  for (;;) {
+    struct op *next_pc = op+1;
+    
+    switch (op->code) {
+    case OP_BRANCH: {
+      if (!sp) { goto missing_values; }
+      lanes_t taken = (ls.stack[--sp] != 0) & mask;
+      bool all = true, none = true;
+
+      for (uint8_t l = 0; l < LANE_COUNT; l++) {
+	if (mask[l]) {
+	  if (taken[l]) { none = false; } else { all = false; }
+	}
+      }
+      
+      if (none) {
+	next_pc = op->as_branch.false_pc;
+      } else if (!all) {
+	for (uint8_t l = 0; l < LANE_COUNT; l++) {
+	  if (mask[l] && !taken[l]) {
+	    ls.pc[l] = op->as_branch.false_pc;
+	    ls.stack_size[l] = sp;
+	  }
+	}
+
+	mask = taken;
+	split = true;
+      }
+
+      break;
+    }
+    case OP_CALL: {
+      if (sp < 2) { goto missing_values; }
+      lanes_t x = ls.stack[sp-2], y = ls.stack[sp-1];
+      ls.stack[sp-2] = BLEND(mask, (op->as_call.func == &add_func) ? x + y : x - y, x);
+      sp--;
+      break;
+    }
+    case OP_DROP:
+      if (sp < op->as_drop.count) { goto missing_values; }
+      sp -= op->as_drop.count;
+      break;
+    case OP_EQUAL: {
+      struct op_equal *e = &op->as_equal;
+      if (sp < !e->x.type + !e->y.type) { goto missing_values; }
+      lanes_t x = {0}, y = {0};
+      if (e->y.type) { y += e->y.as_int; } else { y = ls.stack[--sp]; }
+      if (e->x.type) { x += e->x.as_int; } else { x = ls.stack[--sp]; }
+      if (sp == MAX_STACK_SIZE) { goto stack_overflow; }
+      ls.stack[sp] = BLEND(mask, x == y, ls.stack[sp]);
+      sp++;
+      break;
+    }
+    case OP_JUMP:
+      next_pc = op->as_jump.pc;
+
+      if (next_pc <= op && interrupted) {
+	interrupted = 0;
+	error(vm, form_pos(vm, op->form), "Interrupted");
+	return EVAL_ERROR;
+      }
+      
+      break;
+    case OP_LOAD:
+      if (!sp) { goto missing_values; }
+      assert(op->as_load.reg < MAX_REG_COUNT);
+      sp--;
+      ls.regs[op->as_load.reg] = BLEND(mask, ls.stack[sp], ls.regs[op->as_load.reg]);
+      break;
+    case OP_NOP:
+      break;
+    case OP_PUSH:
+      if (sp == MAX_STACK_SIZE) { goto stack_overflow; }
+      ls.stack[sp] = BLEND(mask, (lanes_t){0} + op->as_push.val.as_int, ls.stack[sp]);
+      sp++;
+      break;
+    case OP_RET:
+      if (sp < func->nrets) {
+	error(vm, form_pos(vm, op->form), "Missing return values: %s", func->name);
+	return EVAL_ERROR;
+      }
+      
+      for (uint8_t l = 0; l < LANE_COUNT; l++) {
+	if (!mask[l]) { continue; }
+	
+	for (uint8_t i = 0; i < func->nrets; i++) {
+	  rets[l*func->nrets + i] = ls.stack[sp - func->nrets + i][l];
+	}
+      }
+
+      next_pc = NULL;
+      break;
+    case OP_STORE:
+      if (sp == MAX_STACK_SIZE) { goto stack_overflow; }
+      assert(op->as_store.reg < MAX_REG_COUNT);
+      ls.stack[sp] = BLEND(mask, ls.regs[op->as_store.reg], ls.stack[sp]);
+      sp++;
+      break;
+    case OP_STOP:
+      assert(false);
+    }
+
+    if (!split && next_pc) {
+      op = next_pc;
+      continue;
+    }
+
+    /* Parks the current group and continues with the group at the lowest pc, merging groups that meet. */
+    
+    for (uint8_t l = 0; l < LANE_COUNT; l++) {
+      if (mask[l]) {
+	ls.pc[l] = next_pc;
+	ls.stack_size[l] = sp;
+      }
+    }
+
+    op = NULL;
+    
+    for (uint8_t l = 0; l < LANE_COUNT; l++) {
+      if (ls.pc[l] && (!op || ls.pc[l] < op)) { op = ls.pc[l]; }
+    }
+
+    if (!op) { break; }
+    split = false;
+    
+    for (uint8_t l = 0; l < LANE_COUNT; l++) {
+      mask[l] = (ls.pc[l] == op) ? -1 : 0;
+      if (mask[l]) { sp = ls.stack_size[l]; } else if (ls.pc[l]) { split = true; }
+    }
+
+    continue;
+  missing_values:
+    error(vm, form_pos(vm, op->form), "Not enough values");
+    return EVAL_ERROR;
+  stack_overflow:
+    error(vm, form_pos(vm, op->form), "Stack overflow");
+    return EVAL_ERROR;
+  }
+
+  return EVAL_OK;
+}
+
+/* Evaluates func once for each of the count tuples of nargs Ints in args, 
+   and stores the nrets Ints returned by each in rets; func has to take and return Ints only. */
+
+enum eval_res eval_batch(struct vm *vm, struct func *func, form_t form, const int_t *args, int_t *rets, uint32_t count) {
+  for (uint8_t i = 0; i < func->nargs; i++) { assert(func->args[i].type == &int_type); }
+  for (uint8_t i = 0; i < func->nrets; i++) { assert(func->rets[i] == &int_type); }
+
+  if (vector_end(func)) {
+    for (uint32_t i = 0; i < count; i += LANE_COUNT) {
+      uint8_t n = (count - i < LANE_COUNT) ? count - i : LANE_COUNT;
+      enum eval_res res = eval_lanes(vm, func, args + i*func->nargs, rets + i*func->nrets, n);
+      if (res != EVAL_OK) { return res; }
+    }
+
+    return EVAL_OK;
+  }
+  
+  for (uint32_t i = 0; i < count; i++) {
+    for (uint8_t j = 0; j < func->nargs; j++) {
+      push_init(vm, &int_type)->as_int = args[i*func->nargs + j];
+    }
+    
+    enum eval_res res = eval_call(vm, func, form);
+    if (res != EVAL_OK) { return res; }
+    
+    for (uint8_t j = func->nrets; j > 0; j--) {
+      rets[i*func->nrets + j-1] = pop_slot(vm)->as_int;
+    }
+  }
+
+  return EVAL_OK;
+}
+
+/* Maps func over a range in batches of BATCH_SIZE and appends the results to a Vec, 
+   interrupts and deadlines are checked between batches since eval_batch doesn't burn fuel. */
+
+#define BATCH_SIZE (LANE_COUNT * 16)
+
+struct op *batch_map_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val f = pop(vm), end = pop(vm), start = pop(vm), acc = pop(vm);
+  form_t form = (ret_pc-1)->form;
+  struct pos pos = form_pos(vm, form);
+  
+  if (start.type != &int_type || end.type != &int_type) {
+    error(vm, pos, "Invalid range");
+    return NULL;
+  }
+  
+  int_t args[BATCH_SIZE], rets[BATCH_SIZE];
+  
+  for (int_t i = start.as_int; i < end.as_int;) {
+    if (interrupted) {
+      interrupted = 0;
+      error(vm, pos, "Interrupted");
+      return NULL;
+    }
+
+    if (deadline_passed(vm)) {
+      error(vm, pos, "Deadline exceeded");
+      return NULL;
+    }
+    
+    uint32_t n = 0;
+    while (n < BATCH_SIZE && i < end.as_int) { args[n++] = i++; }
+    if (eval_batch(vm, f.as_func, form, args, rets, n) != EVAL_OK) { return NULL; }
+
+    for (uint32_t j = 0; j < n; j++) {
+      struct val x;
+      val_init(&x, &int_type)->as_int = rets[j];
+      
+      if (!node_reserve(vm, NODE_RESERVE, &acc, 1) || !(acc.as_vec = vec_set(vm, acc.as_vec, node_count(acc.as_vec), x))) {
+	error(vm, pos, "Vec overflow");
+	return NULL;
+      }
+    }
+  }
+
+  push(vm, acc);
+  return ret_pc;
+}
+
+/*** Readers
+     Readers transform code into forms.
+     read_form() dispatches on the first character through readers[], new readers must be added there.
+***/
+
+typedef enum read_res(*reader_t)(struct vm *vm, struct pos *pos, struct in *in);
+
+enum read_res read_group(struct vm *vm, struct pos *pos, struct in *in);
+enum read_res read_id(struct vm *vm, struct pos *pos, struct in *in);
+enum read_res read_int(struct vm *vm, struct pos *pos, struct in *in);
+enum read_res read_semi(struct vm *vm, struct pos *pos, struct in *in);
+enum read_res read_str(struct vm *vm, struct pos *pos, struct in *in);
+enum read_res read_ws(struct vm *vm, struct pos *pos, struct in *in);
+
+static const reader_t readers[256] = {
+  [1 ... 255] = read_id,
+  [' '] = read_ws, ['\t'] = read_ws, ['\n'] = read_ws, ['\r'] = read_ws,
+  ['-'] = read_int, ['0' ... '9'] = read_int,
+  [';'] = read_semi,
+  ['"'] = read_str,
+  ['('] = read_group,
+  [')'] = NULL
+};
+
+enum read_res read_form(struct vm *vm, struct pos *pos, struct in *in) {
+  for (;;) {
+    reader_t r = readers[(uint8_t)in_peek(in)];
+    if (!r) { return READ_NULL; }
+    enum read_res res = r(vm, pos, in);
+    if (r != read_ws) { return res; }
+  }
+}
+
+enum read_res read_group(struct vm *vm, struct pos *pos, struct in *in) {
+  struct pos fpos = *pos;  
+  in->start++;
+  pos->column++;
+  form_t f = new_form(vm, FORM_GROUP, fpos);
+
+  if (f == FORM_NULL) {
+    in_error(in, vm, fpos, "%s", forms_full(vm));
+    return READ_ERROR;
+  }
+
+  for (;;) {
+    enum read_res res = read_form(vm, pos, in);
+    if (res == READ_ERROR) { return res; }
+    if (res == READ_NULL) { break; }
+  }
+
+  if (in_peek(in) != ')') {
+    in_error(in, vm, fpos, "Open group");
+    return READ_ERROR;
+  }
+
+  read_target(vm)->ends[f] = read_target(vm)->count;
+  in->start++;
+  pos->column++;
+  return READ_OK;
+}
+
+enum read_res read_id(struct vm *vm, struct pos *pos, struct in *in) {
+  size_t n = scan_id(in->start, in->end) - in->start;
+  
+  while (in->start + n == in->end && in_fill(in)) {
+    n = scan_id(in->start + n, in->end) - in->start;
+  }
+  
+  if (!n) { return READ_NULL; }
+
+  if (n >= MAX_NAME_LENGTH) {
+    in_error(in, vm, *pos, "Id too long");
+    in->start += n;
+    pos->column += n;
+    return READ_ERROR;
+  }
+  
+  if (new_id(vm, *pos, in->start, n) == FORM_NULL) {
+    in_error(in, vm, *pos, "%s", forms_full(vm));
+    return READ_ERROR;
+  }
+
+  in->start += n;
+  pos->column += n;
+  return READ_OK;
+}
+
+enum read_res read_int(struct vm *vm, struct pos *pos, struct in *in) {
+  bool neg = *in->start == '-';
+
+  if (neg && (!in_want(in, 2) || !isdigit(in->start[1]))) {
+    return read_id(vm, pos, in);
+  }
+
+  size_t n = neg;
+  
+  for (;;) {
+    while (in->start + n < in->end && isdigit(in->start[n])) { n++; }
+    if (in->start + n < in->end || !in_fill(in)) { break; }
+  }
+
+  const char *p = in->start + neg, *end = in->start + n;
+  uint64_t v = 0;
+  
+  for (; end - p > 8; p++) { v = v * 10 + *p - '0'; }
+
+  if (p + 8 <= in->buf + MAX_IN_LENGTH) {
+    uint64_t s = 1;
+    for (const char *c = p; c < end; c++) { s *= 10; }
+    v = v * s + swar_digits(p, end - p);
+  } else {
+    for (; p < end; p++) { v = v * 10 + *p - '0'; }
+  }
+  
+  struct val *lit = new_lit(vm, *pos, &int_type);
+
+  if (!lit) {
+    in_error(in, vm, *pos, "%s", forms_full(vm));
+    return READ_ERROR;
+  }
+
+  lit->as_int = neg ? -(int_t)v : (int_t)v;
+  in->start += n;
+  pos->column += n;
+  return READ_OK;
+}
+
+enum read_res read_semi(struct vm *vm, struct pos *pos, struct in *in) {
+  if (new_form(vm, FORM_SEMI, *pos) == FORM_NULL) {
+    in_error(in, vm, *pos, "%s", forms_full(vm));
+    return READ_ERROR;
+  }
+
+  in->start++;
+  pos->column++;
+  return READ_OK;
+}
+    
+/* Strings are interned, which keeps values small and gives them a stable address. */
+
+enum read_res read_str(struct vm *vm, struct pos *pos, struct in *in) {
+  struct pos fpos = *pos;
+  in->start++;
+  pos->column++;
+  size_t n = 0;
+
+  for (;;) {
+    char *q = memchr(in->start + n, '"', in->end - in->start - n);
+
+    if (q) {
+      n = q - in->start;
+      break;
+    }
+
+    n = in->end - in->start;
+    
+    if (!in_fill(in)) {
+      in_error(in, vm, fpos, "Open str");
+      return READ_ERROR;
+    }
+  }
+
+  for (const char *c = in->start; c < in->start + n; c++) {
+    if (*c == '\n') {
+      pos->line++;
+      pos->column = 0;
+    } else {
+      pos->column++;
+    }
+  }
+  
+  sym_t s = read_sym(vm, in->start, n);
+  struct val *lit = (s == SYM_NULL) ? NULL : new_lit(vm, fpos, &str_type);
+
+  if (!lit) {
+    in_error(in, vm, fpos, "%s", forms_full(vm));
+    return READ_ERROR;
+  }
+
+  lit->as_str = sym_name(&vm->syms, s);
+  in->start += n+1;
+  pos->column++;
+  return READ_OK;
+}
+
+enum read_res read_ws(struct vm *vm, struct pos *pos, struct in *in) {
+  for (;;) {
+    char *p = scan_blank(in->start, in->end);
+    pos->column += p - in->start;
+    in->start = p;
+
+    if (p == in->end) {
+      if (!in_fill(in)) { break; }
+    } else if (*p == '\n') {
+      pos->line++;
+      pos->column = 0;
+      in->start++;
+    } else if (*p == '\r') {
+      in->start++;
+    } else {
+      break;
+    }
+  }
+  
+  return READ_NULL;
+}
+
+/* Reads forms up to the next semicolon, which is dropped. */
+
+enum read_res read_forms(struct vm *vm, struct pos *pos, struct in *in, struct form_range *out) {
+  struct forms *fs = read_target(vm);
+  form_range_init(out, fs->count, fs->count);
+  
+  for (;;) {
+    form_t f = fs->count;
+    
+    switch (read_form(vm, pos, in)) {
+    case READ_OK:
+      if (fs->types[f] == FORM_SEMI) { return READ_OK; }
+      out->end = fs->count;
+      break;
+    case READ_NULL:
+      /* NUL ends input like EOF, reporting it would only repeat the error that stopped at it. */
+      if (in_eof(in) || !*in->start) { return form_range_null(out) ? READ_NULL : READ_OK; }
+      in_error(in, vm, *pos, "Unexpected input: %c", *in->start);
+      in->start++;
+      pos->column++;
+      return READ_ERROR;
+    case READ_ERROR:
+      return READ_ERROR;
+    }
+  }
+}
+
+/*** Pipelines
+     Pipelines read forms on a separate thread while previously read forms are emitted and evaluated.
+     Each batch holds the forms up to the next semicolon, 
+     batches are passed through a single producer/consumer ring with semaphores parking whichever side runs ahead.
+     Forms are read into a stage of the pipeline's own and moved into the VM as batches are taken,
+     which leaves the VM free to reclaim its forms between batches; the reader only takes the read lock to intern syms.
+     The stage is reset once it's half full and every batch read so far has been taken.
+     Batches are read inline by pipeline_next() when the reader thread couldn't be started.
+***/
+
+struct batch {
+  struct form_range forms;
+  enum read_res res;
+};
+
+struct pipeline {
+  struct vm *vm;
+  struct in *in;
+  struct pos pos;
+  struct forms stage;
+  
+  struct batch batches[MAX_BATCH_COUNT];
+  uint32_t head, tail;
+  sem_t filled, free;
+  atomic_bool stop;
+  pthread_t thread;
+  bool threaded;
+};
+
+struct pipeline *pipeline_init(struct pipeline *self, struct vm *vm, struct in *in, struct pos pos) {
+  self->vm = vm;
+  self->in = in;
+  self->pos = pos;
+  forms_init(&self->stage, 0);
+  self->head = self->tail = 0;
+  sem_init(&self->filled, 0, 0);
+  sem_init(&self->free, 0, MAX_BATCH_COUNT);
+  atomic_init(&self->stop, false);
+  self->threaded = false;
+  return self;
+}
+
+/* Holding every free slot means that all batches read so far have been taken. */
+
+bool pipeline_drain(struct pipeline *self) {
+  uint32_t n = 1;
+  
+  for (; n < MAX_BATCH_COUNT && !atomic_load(&self->stop); n++) { sem_wait(&self->free); }
+  if (atomic_load(&self->stop)) { return false; }
+  forms_init(&self->stage, 0);
+  for (; n > 1; n--) { sem_post(&self->free); }
+  return true;
+}
+
+/* Reads the next batch into the stage, returns false once there's nothing more to read. */
+
+bool pipeline_step(struct pipeline *self) {
+  sem_wait(&self->free);
+  if (atomic_load(&self->stop)) { return false; }
+    
+  if ((self->stage.count > MAX_FORM_COUNT/2 || self->stage.lit_count > MAX_LIT_COUNT/2) && !pipeline_drain(self)) {
+    return false;
+  }
+    
+  struct batch *b = self->batches + self->head++ % MAX_BATCH_COUNT;
+  b->res = read_forms(self->vm, &self->pos, self->in, &b->forms);
+  sem_post(&self->filled);
+  return b->res == READ_OK;
+}
+
+void *pipeline_read(void *arg) {
+  struct pipeline *self = arg;
+  read_stage = &self->stage;
+  while (pipeline_step(self));
+  return NULL;
+}
+
+void pipeline_start(struct pipeline *self) {
+  self->threaded = pthread_create(&self->thread, NULL, pipeline_read, self) == 0;
+}
+
+/* Moves the next batch into the VM, errors end up in vm->error. */
+
+struct batch pipeline_next(struct pipeline *self) {
+  if (!self->threaded) {
+    read_stage = &self->stage;
+    pipeline_step(self);
+    read_stage = NULL;
+  }
+  
+  sem_wait(&self->filled);
+  struct batch b = self->batches[self->tail++ % MAX_BATCH_COUNT];
+  
+  if (b.res == READ_ERROR) {
+    strcpy(self->vm->error, self->in->error);
+  } else if (b.res == READ_OK) {
+    pthread_mutex_lock(&self->vm->read_lock);
+    if (!forms_take(self->vm, &self->stage, &b.forms)) { b.res = READ_ERROR; }
+    pthread_mutex_unlock(&self->vm->read_lock);
+  }
+  
+  sem_post(&self->free);
+  return b;
+}
+
+void pipeline_stop(struct pipeline *self) {
+  atomic_store(&self->stop, true);
+  sem_post(&self->free);
+  if (self->threaded) { pthread_join(self->thread, NULL); }
+  sem_destroy(&self->filled);
+  sem_destroy(&self->free);
+}
+
+void macro_dump(struct val *val, FILE *out) {
+  fprintf(out, "Macro(%s)", val->as_macro->name);
+}
+
+enum emit_res macro_emit(struct val *val, form_t form, struct form_range *in, struct vm *vm) {
+  struct macro *self = val->as_macro;
+  form_t a = in->start;
+
+  for (uint8_t i = 0; i < self->nargs; i++, a = vm->forms.ends[a]) {
+    if (a == in->end) {
+      error(vm, form_pos(vm, form), "Missing macro arguments: %s %" PRIu8, self->name, i);
+      return EMIT_ERROR;
+    }
+  }
+
+  return self->body(self, form, in, vm);
+}
+
+struct val *macro_lit(struct val *val) {
+  return NULL;
+}
+
+uint8_t macro_nargs(struct val *val) {
+  return val->as_macro->nargs;
+}
+
+struct op *add_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  slot_t *y = pop_slot(vm);
+  peek(vm)->as_int += y->as_int;
+  return ret_pc;
+}
+
+bool is_macro(struct vm *vm, form_t form, macro_body_t body);
+
+/* Emits the arguments of a bound or anonymous func like a call would and returns the func, 
+   anonymous funcs are pushed at compile time. */
+
+struct func *emit_func_args(struct vm *vm, form_t form, struct form_range *in, const char *what) {
+  struct val *v = NULL, anon;
+  
+  if (is_macro(vm, form, func_body)) {
+    if (form_emit(form, in, vm) != EMIT_OK) { return NULL; }
+    anon = pop(vm);
+    v = &anon;
+  } else if (form_type(vm, form) == FORM_ID) {
+    v = find(vm, form_id(vm, form));
+  }
+
+  if (!v || v->type != &func_type) {
+    error(vm, form_pos(vm, form), "Invalid %s func", what);
+    return NULL;
+  }
+
+  struct func *func = v->as_func;
+  
+  for (uint8_t i = 0; i < func->nargs; i++) {
+    if (form_range_null(in)) {
+      error(vm, form_pos(vm, form), "Missing func arguments: %s %" PRIu8, func->name, i);
+      return NULL;
+    }
+
+    if (form_emit(pop_form(vm, in), in, vm) != EMIT_OK) { return NULL; }
+  }
+
+  return func;
+}
+
+/* Emits the number of repetitions followed by the func's arguments, which are only evaluated once. */
+
+enum emit_res bench_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  enum emit_res res = form_emit(pop_form(vm, in), in, vm);
+  if (res != EMIT_OK) { return res; }
+  struct func *func = emit_func_args(vm, pop_form(vm, in), in, "bench");
+  if (!func) { return EMIT_ERROR; }
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &func_type)->as_func = func;
+  emit(vm, OP_CALL, form)->as_call.func = &bench_call_func;
+  return EMIT_OK;
+}
+
+/* Calls the func repeatedly with the same arguments and pushes the elapsed milliseconds, results are dropped. */
+
+struct op *bench_call_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct func *func = pop(vm).as_func;
+  struct val args[MAX_FUNC_ARG_COUNT];
+  for (uint8_t i = func->nargs; i > 0; i--) { args[i-1] = pop(vm); }
+  struct val reps = pop(vm);
+
+  if (reps.type != &int_type) {
+    error(vm, form_pos(vm, (ret_pc-1)->form), "Invalid repetitions");
+    return NULL;
+  }
+
+  struct state *s = peek_state(vm);
+  uint8_t stack_size = s->stack_size;
+  struct pin pin;
+  pin_init(&pin, vm, args, func->nargs);
+  uint64_t start = now_ms();
+  
+  for (int_t i = 0; i < reps.as_int; i++) {
+    for (struct val *a = args; a < args + func->nargs; a++) { push(vm, *a); }
+
+    if (eval_call(vm, func, (ret_pc-1)->form) != EVAL_OK) {
+      unpin(vm, &pin);
+      return NULL;
+    }
+    
+    s->stack_size = stack_size;
+  }
+
+  unpin(vm, &pin);
+
+  push_init(vm, &int_type)->as_int = now_ms() - start;
+  return ret_pc;
+}
+
+struct op *chan_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val x = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+
+  if (x.type != &int_type || x.as_int < 0 || x.as_int > MAX_CHANNEL_LENGTH) {
+    error(vm, pos, "Invalid channel capacity");
+    return NULL;
+  }
+
+  if (vm->channel_count == MAX_CHANNEL_COUNT) {
+    error(vm, pos, "Too many channels");
+    return NULL;
+  }
+
+  push_init(vm, &chan_type)->as_channel = channel_init(vm->channels + vm->channel_count++, x.as_int);
+  return ret_pc;
+}
+
+struct op *debug_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  vm->debug = !vm->debug;
+  push_init(vm, &bool_type)->as_bool = vm->debug;
+  return ret_pc;
+}
+
+struct op *dict_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  push_init(vm, &dict_type)->as_dict = NULL;
+  return ret_pc;
+}
+
+enum emit_res equal_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  form_t x = pop_form(vm, in);
+  struct val *xv = form_val(x, vm);
+  
+  if (!xv) {
+    enum emit_res fr = form_emit(x, in, vm);
+    if (fr != EMIT_OK) { return fr; }
+  }
+
+  form_t y = pop_form(vm, in);
+  struct val *yv = form_val(y, vm);
+
+  if (!yv) {
+    enum emit_res fr = form_emit(y, in, vm);
+    if (fr != EMIT_OK) { return fr; }
+  }
+
+  struct op_equal *op = &emit(vm, OP_EQUAL, form)->as_equal;
+  if (xv) { op->x = *xv; }
+  if (yv) { op->y = *yv; }
+  return EMIT_OK;
+}
+
+struct op *fiber_end_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  vm->fiber->status = FIBER_DONE;
+  return fiber_switch(vm, form_pos(vm, (ret_pc-1)->form));
+}
+
+/* Moves the func's arguments to a new fiber that's ready to call it, the running fiber carries on. */
+
+struct op *fiber_start_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct func *func = pop(vm).as_func;
+  struct fiber *f = vm->fibers + 1;
+  while (f < vm->fibers + vm->fiber_count && f->status != FIBER_DONE) { f++; }
+  form_t form = (ret_pc-1)->form;
+  
+  if (f == vm->fibers + MAX_FIBER_COUNT) {
+    error(vm, form_pos(vm, form), "Too many fibers");
+    return NULL;
+  }
+
+  if (f == vm->fibers + vm->fiber_count) { vm->fiber_count++; }
+  stack_move(peek_state(vm), state_init(f->states), func->nargs);
+  f->state_count = 1;
+  f->frame_count = 0;
+  op_init(f->start_ops, OP_CALL, form)->as_call.func = func;
+  op_init(f->start_ops+1, OP_CALL, form)->as_call.func = &fiber_end_func;
+  f->pc = f->start_ops;
+  f->status = FIBER_READY;
+  return ret_pc;
+}
+
+struct op *__func_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  if (!self->start_pc) {
+    error(vm, form_pos(vm, (ret_pc-1)->form), "Func isn't compiled yet: %s", self->name);
+    return NULL;
+  }
+  
+  struct state *caller = peek_state(vm);
+  assert(caller->stack_size >= self->nargs);
+
+  if (!push_frame(vm, self, ret_pc)) {
+    error(vm, form_pos(vm, (ret_pc-1)->form), "Too deep: %s", self->name);
+    return NULL;
+  }
+  
+  stack_to_regs(caller, peek_state(vm), self->nargs);
+  return self->start_pc;
+}
+
+struct type *find_type(struct vm *vm, form_t form) {
+  if (form_type(vm, form) != FORM_ID) { return NULL; }
+  struct val *v = find(vm, form_id(vm, form));
+  return (v && v->type == &meta_type) ? v->as_meta : NULL;
+}
+
+/* Redefining a func in the same scope reuses it, since that's what compiled calls refer to;
+   the signature has to stay the same, the new body takes over once it's compiled. */
+
+struct func *redef_func(struct vm *vm, struct func *self, form_t form,
+			uint8_t nargs, struct func_arg *args, uint8_t nrets, struct type **rets) {
+  bool same = self->nargs == nargs && self->nrets == nrets && memcmp(self->rets, rets, nrets*sizeof(struct type *)) == 0;
+  for (uint8_t i = 0; same && i < nargs; i++) { same = self->args[i].type == args[i].type; }
+
+  if (!same) {
+    error(vm, form_pos(vm, form), "Changed signature: %s", self->name);
+    return NULL;
+  }
+
+  memcpy(self->args, args, nargs*sizeof(struct func_arg));
+  return self;
+}
+
+struct func *new_func(struct vm *vm, form_t name_form, form_t args_form, form_t rets_form) {
+  if (form_type(vm, name_form) != FORM_ID) {
+    error(vm, form_pos(vm, name_form), "Invalid func name");
+    return NULL;
+  }
+
+  if (form_type(vm, args_form) != FORM_GROUP) {
+    error(vm, form_pos(vm, args_form), "Invalid func args");
+    return NULL;
+  }
+  
+  struct func_arg args[MAX_FUNC_ARG_COUNT];
+  uint8_t nargs = 0;
+
+  for (struct form_range in = form_items(vm, args_form); !form_range_null(&in);) {
+    form_t name = pop_form(vm, &in);
+
+    if (form_type(vm, name) != FORM_ID || form_range_null(&in) || nargs == MAX_FUNC_ARG_COUNT) {
+      error(vm, form_pos(vm, name), "Invalid func arg");
+      return NULL;
+    }
+
+    form_t type = pop_form(vm, &in);
+    struct type *t = find_type(vm, type);
+
+    if (!t) {
+      error(vm, form_pos(vm, type), "Invalid arg type");
+      return NULL;
+    }
+    
+    args[nargs++] = arg(form_id(vm, name), t);
+  }
+
+  if (form_type(vm, rets_form) != FORM_GROUP) {
+    error(vm, form_pos(vm, rets_form), "Invalid func rets");
+    return NULL;
+  }
+
+  struct type *rets[MAX_FUNC_RET_COUNT];
+  uint8_t nrets = 0;
+
+  for (struct form_range in = form_items(vm, rets_form); !form_range_null(&in);) {
+    form_t type = pop_form(vm, &in);
+    struct type *t = find_type(vm, type);
+
+    if (!t || nrets == MAX_FUNC_RET_COUNT) {
+      error(vm, form_pos(vm, type), "Invalid ret type");
+      return NULL;
+    }
+
+    rets[nrets++] = t;
+  }
+
+  const char *name = form_id(vm, name_form);
+  struct val *prev = env_get(&peek_scope(vm)->bindings, name);
+
+  if (prev && prev->type == &func_type && prev->as_func->body == __func_body) {
+    return redef_func(vm, prev->as_func, name_form, nargs, args, nrets, rets);
+  }
+  
+  if (vm->func_count == MAX_FUNC_COUNT) {
+    error(vm, form_pos(vm, name_form), "Too many funcs");
+    return NULL;
+  }
+  
+  return func_init(vm->funcs + vm->func_count++, name, nargs, args, nrets, rets, __func_body);
+}
+
+enum emit_res bind_func(struct vm *vm, struct func *func, form_t form) {
+  struct val *v = bind_id(vm, func->name);
+
+  if (!v) {
+    struct val *prev = env_get(&peek_scope(vm)->bindings, func->name);
+    if (prev && prev->type == &func_type && prev->as_func == func) { return EMIT_OK; }
+    error(vm, form_pos(vm, form), prev ? "Dup binding: %s" : "Too many bindings: %s", func->name);
+    return EMIT_ERROR;
+  }
+
+  val_init(v, &func_type)->as_func = func;
+  return EMIT_OK;
+}
+
+/* Binds args to registers in the current scope, which has to be fresh since the callee starts with empty registers. */
+
+enum emit_res bind_args(struct vm *vm, struct func *func, form_t form) {
+  struct scope *s = peek_scope(vm);
+  s->reg_count = 0;
+  
+  for (struct func_arg *a = func->args; a < func->args + func->nargs; a++) {
+    struct val *v = bind_id(vm, a->name);
+    
+    if (!v) {
+      error(vm, form_pos(vm, form), "Dup arg: %s", a->name);
+      return EMIT_ERROR;
+    }
+
+    val_init(v, &reg_type)->as_reg = s->reg_count++;
+  }
+
+  return EMIT_OK;
+}
+
+struct func_def *find_def(struct vm *vm, form_t form) {
+  for (struct func_def *d = vm->defs; d < vm->defs + vm->def_count; d++) {
+    if (d->form == form) { return d; }
+  }
+
+  return NULL;
+}
+
+enum emit_res func_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  form_t name_form = pop_form(vm, in);
+  form_t args_form = pop_form(vm, in);
+  form_t rets_form = pop_form(vm, in);
+  form_t body = pop_form(vm, in);
+  struct func_def *def = find_def(vm, form);
+  struct func *func = def ? def->func : new_func(vm, name_form, args_form, rets_form);
+  if (!func) { return EMIT_ERROR; }
+  bool anon = strcmp(func->name, "_") == 0;
+  
+  if (!def && !anon && bind_func(vm, func, name_form) != EMIT_OK) {
+    return EMIT_ERROR;
+  }
+
+  if (!push_scope(vm)) {
+    error(vm, form_pos(vm, form), "Too many scopes");
+    return EMIT_ERROR;
+  }
+  
+  enum emit_res res = bind_args(vm, func, args_form);
+  if (res == EMIT_OK) { res = func_emit(func, body, in, vm); }
+  pop_scope(vm);
+  if (res != EMIT_OK) { return res; }
+  
+  if (anon) {
+    push_init(vm, &func_type)->as_func = func;
+  }
+
+  return EMIT_OK;
+}
+
+enum emit_res macro_expand_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm);
+
+/* Compiles the body into a func of the macro's args, which is called whenever the macro is emitted. 
+   The macro is bound once its body is compiled, recursive macros have to be expanded through quotes. */
+
+enum emit_res macro_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  form_t name_form = pop_form(vm, in);
+  form_t args_form = pop_form(vm, in);
+  form_t body = pop_form(vm, in);
+
+  if (form_type(vm, name_form) != FORM_ID) {
+    error(vm, form_pos(vm, name_form), "Invalid macro name");
+    return EMIT_ERROR;
+  }
+
+  if (form_type(vm, args_form) != FORM_GROUP) {
+    error(vm, form_pos(vm, args_form), "Invalid macro args");
+    return EMIT_ERROR;
+  }
+
+  struct func_arg args[MAX_FUNC_ARG_COUNT];
+  uint8_t nargs = 0;
+
+  for (struct form_range r = form_items(vm, args_form); !form_range_null(&r);) {
+    form_t a = pop_form(vm, &r);
+
+    if (form_type(vm, a) != FORM_ID || nargs == MAX_FUNC_ARG_COUNT) {
+      error(vm, form_pos(vm, a), "Invalid macro arg");
+      return EMIT_ERROR;
+    }
+
+    args[nargs++] = arg(form_id(vm, a), NULL);
+  }
+
+  if (vm->func_count == MAX_FUNC_COUNT || vm->macro_count == MAX_MACRO_COUNT || vm->scope_count == MAX_SCOPE_COUNT) {
+    error(vm, form_pos(vm, form),
+	  (vm->func_count == MAX_FUNC_COUNT) ? "Too many funcs" :
+	  (vm->macro_count == MAX_MACRO_COUNT) ? "Too many macros" : "Too many scopes");
+    
+    return EMIT_ERROR;
+  }
+
+  const char *name = form_id(vm, name_form);
+  
+  struct func *func = func_init(vm->funcs + vm->func_count++, name,
+				nargs, args, 1, (struct type *[]){NULL},
+				__func_body);
+
+  push_scope(vm);
+  enum emit_res res = bind_args(vm, func, args_form);
+  if (res == EMIT_OK) { res = func_emit(func, body, in, vm); }
+  pop_scope(vm);
+  if (res != EMIT_OK) { return res; }
+  struct val *v = bind_id(vm, name);
+
+  if (!v) {
+    bool dup = env_get(&peek_scope(vm)->bindings, name);
+    error(vm, form_pos(vm, name_form), dup ? "Dup binding: %s" : "Too many bindings: %s", name);
+    return EMIT_ERROR;
+  }
+
+  struct macro *m = macro_init(vm->macros + vm->macro_count++, name, nargs, UINT8_MAX, macro_expand_body);
+  m->func = func;
+  val_init(v, &macro_type)->as_macro = m;
+  return EMIT_OK;
+}
+
+form_t form_copy(struct vm *vm, form_t form, struct state *fill);
+
+/* Literal args are passed as values and anything else as Quotes, 
+   the result is emitted in place of the macro; Quotes as forms and anything else as a literal. */
+
+enum emit_res macro_expand_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  if (peek_state(vm)->stack_size + self->nargs > MAX_STACK_SIZE) {
+    error(vm, form_pos(vm, form), "Stack overflow");
+    return EMIT_ERROR;
+  }
+  
+  for (uint8_t i = 0; i < self->nargs; i++) {
+    form_t a = pop_form(vm, in);
+
+    if (form_type(vm, a) == FORM_LIT) {
+      push(vm, *form_lit(vm, a));
+    } else {
+      push_init(vm, &quote_type)->as_quote = a;
+    }
+  }
+
+  vm->expand_depth++;
+  enum eval_res res = eval_call(vm, self->func, form);
+  vm->expand_depth--;
+  if (res != EVAL_OK) { return EMIT_ERROR; }
+  struct val v = pop(vm);
+  
+  if (v.type != &quote_type) {
+    emit(vm, OP_PUSH, form)->as_push.val = v;
+    return EMIT_OK;
+  }
+
+  form_t f = v.as_quote;
+
+  if (f < vm->forms.start) {
+    pthread_mutex_lock(&vm->read_lock);
+    f = form_copy(vm, f, NULL);
+    if (f == FORM_NULL) { error(vm, form_pos(vm, form), "%s", forms_full(vm)); }
+    pthread_mutex_unlock(&vm->read_lock);
+    if (f == FORM_NULL) { return EMIT_ERROR; }
+  }
+  
+  return form_emit(f, in, vm);
+}
+
+/* Returns a form for val, Quotes are copied and anything else becomes a literal. */
+
+form_t val_form(struct vm *vm, struct val val, struct pos pos) {
+  if (val.type == &quote_type) { return form_copy(vm, val.as_quote, NULL); }
+  form_t self = vm->forms.count;
+  struct val *lit = new_lit(vm, pos, val.type);
+  if (!lit) { return FORM_NULL; }
+  *lit = val;
+  return self;
+}
+
+/* Copies form to the end of the VM's forms from wherever it belongs, 
+   copies made while filling quotes replace Reg literals with the values of the registers in state.
+   Returns FORM_NULL once out of room, like new_form(). */
+
+form_t form_copy(struct vm *vm, form_t form, struct state *fill) {
+  struct vm *src = vm;
+  while (form < src->forms.start) { src = src->snapshot; }
+  struct forms *fs = &src->forms;
+  struct pos pos = fs->pos[form];
+  
+  switch (fs->types[form]) {
+  case FORM_GROUP: {
+    form_t self = new_form(vm, FORM_GROUP, pos);
+    if (self == FORM_NULL) { return FORM_NULL; }
+    
+    for (form_t f = form+1; f < fs->ends[form]; f = fs->ends[f]) {
+      if (form_copy(vm, f, fill) == FORM_NULL) { return FORM_NULL; }
+    }
+    
+    vm->forms.ends[self] = vm->forms.count;
+    return self;
+  }
+  case FORM_ID: {
+    const char *name = sym_name(&src->syms, fs->data[form]);
+    return new_id(vm, pos, name, strlen(name));
+  }
+  case FORM_LIT: {
+    struct val *v = fs->lits + fs->data[form];
+
+    if (fill && v->type == &reg_type) { return val_form(vm, reg_get(fill, v->as_reg), pos); }
+    
+    return val_form(vm, *v, pos);
+  }
+  case FORM_SEMI:
+    return new_form(vm, FORM_SEMI, pos);
+  }
+
+  return FORM_NULL;
+}
+
+/* Copies form with ids bound to args replaced by literals of their registers. */
+
+form_t quote_mark(struct vm *vm, form_t form) {
+  switch (form_type(vm, form)) {
+  case FORM_GROUP: {
+    form_t self = new_form(vm, FORM_GROUP, form_pos(vm, form));
+    if (self == FORM_NULL) { return FORM_NULL; }
+    struct form_range items = form_items(vm, form);
+    
+    while (!form_range_null(&items)) {
+      if (quote_mark(vm, pop_form(vm, &items)) == FORM_NULL) { return FORM_NULL; }
+    }
+    
+    vm->forms.ends[self] = vm->forms.count;
+    return self;
+  }
+  case FORM_ID: {
+    struct val *v = find(vm, form_id(vm, form));
+    if (v && v->type == &reg_type) { return val_form(vm, *v, form_pos(vm, form)); }
+    break;
+  }
+  default:
+    break;
+  }
+
+  return form_copy(vm, form, NULL);
+}
+
+/* Slices point into line buffers that are reused, storing one in a Vec or Dict interns its text as a Str.
+   Returns false once out of syms. */
+
+bool val_keep(struct vm *vm, struct val *val) {
+  if (val->type != &slice_type) { return true; }
+  pthread_mutex_lock(&vm->read_lock);
+  sym_t s = sym(&vm->syms, val->as_slice->start, val->as_slice->length);
+  pthread_mutex_unlock(&vm->read_lock);
+  if (s == SYM_NULL) { return false; }
+  val_init(val, &str_type)->as_str = sym_name(&vm->syms, s);
+  return true;
+}
+
+struct op *push_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val x = pop(vm), v = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+  
+  if (v.type != &vec_type) {
+    error(vm, pos, "Expected Vec: %s", v.type->name);
+    return NULL;
+  }
+
+  if (!val_keep(vm, &x)) {
+    error(vm, pos, "Too many syms");
+    return NULL;
+  }
+
+  struct node *n = node_reserve(vm, NODE_RESERVE, (struct val[]){v, x}, 2) ? vec_set(vm, v.as_vec, node_count(v.as_vec), x) : NULL;
+
+  if (!n) {
+    error(vm, pos, "Vec overflow");
+    return NULL;
+  }
+  
+  push_init(vm, &vec_type)->as_vec = n;
+  return ret_pc;
+}
+
+/* Pushes the form as a Quote, ids bound to args are replaced by their values when evaluated. */
+
+enum emit_res quote_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  form_t f = pop_form(vm, in);
+  bool args = false;
+
+  for (form_t i = f; i < vm->forms.ends[f] && !args; i++) {
+    if (form_type(vm, i) != FORM_ID) { continue; }
+    struct val *v = find(vm, form_id(vm, i));
+    args = v && v->type == &reg_type;
+  }
+
+  if (args) {
+    pthread_mutex_lock(&vm->read_lock);
+    f = quote_mark(vm, f);
+    if (f == FORM_NULL) { error(vm, form_pos(vm, form), "%s", forms_full(vm)); }
+    pthread_mutex_unlock(&vm->read_lock);
+    if (f == FORM_NULL) { return EMIT_ERROR; }
+  }
+  
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &quote_type)->as_quote = f;
+  if (args) { emit(vm, OP_CALL, form)->as_call.func = &quote_fill_func; }
+  return EMIT_OK;
+}
+
+/* Filling copies the quote, which is only allowed while expanding macros to keep calls at runtime from using up forms. */
+
+struct op *quote_fill_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+  
+  if (!vm->expand_depth) {
+    error(vm, pos, "Quote args are only filled while expanding macros");
+    return NULL;
+  }
+  
+  form_t f = peek(vm)->as_quote;
+  pthread_mutex_lock(&vm->read_lock);
+  f = form_copy(vm, f, peek_state(vm));
+  if (f == FORM_NULL) { error(vm, pos, "%s", forms_full(vm)); }
+  pthread_mutex_unlock(&vm->read_lock);
+  if (f == FORM_NULL) { return NULL; }
+  peek(vm)->as_quote = f;
+  return ret_pc;
+}
+
+enum emit_res go_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  struct func *func = emit_func_args(vm, pop_form(vm, in), in, "fiber");
+  if (!func) { return EMIT_ERROR; }
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &func_type)->as_func = func;
+  emit(vm, OP_CALL, form)->as_call.func = &fiber_start_func;
+  return EMIT_OK;
+}
+
+enum emit_res if_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  form_t cf = pop_form(vm, in);
+  enum emit_res fr = form_emit(cf, in, vm);
+  if (fr != EMIT_OK) { return fr; }
+  struct op_branch *b = &emit(vm, OP_BRANCH, form)->as_branch;
+
+  form_t tf = pop_form(vm, in);
+  fr = form_emit(tf, in, vm);
+  if (fr != EMIT_OK) { return fr; }
+
+  struct op_jump *j = &emit(vm, OP_JUMP, form)->as_jump;
+  b->false_pc = pc(vm);
+  form_t ff = pop_form(vm, in);
+  fr = form_emit(ff, in, vm);
+  if (fr != EMIT_OK) { return fr; }
+  j->pc = pc(vm);
+  
+  return EMIT_OK;
+}
+
+struct op *get_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val key = pop(vm), c = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+  struct val *v = NULL;
+  
+  if (c.type == &vec_type) {
+    if (key.type != &int_type) {
+      error(vm, pos, "Expected Int: %s", key.type->name);
+      return NULL;
+    }
+    
+    if (key.as_int >= 0) { v = vec_get(c.as_vec, key.as_int); }
+    
+    if (!v) {
+      error(vm, pos, "Index out of bounds: %" PRId32, key.as_int);
+      return NULL;
+    }
+  } else if (c.type == &dict_type) {
+    if (!key.type->methods.hash) {
+      error(vm, pos, "Invalid key: %s", key.type->name);
+      return NULL;
+    }
+
+    if (!(v = dict_get(c.as_dict, &key))) {
+      error(vm, pos, "Missing key");
+      return NULL;
+    }
+  } else {
+    error(vm, pos, "Expected Vec or Dict: %s", c.type->name);
+    return NULL;
+  }
+
+  push(vm, *v);
+  return ret_pc;
+}
+
+struct op *length_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val x = pop(vm);
+  int_t n = (x.type == &vec_type || x.type == &dict_type) ? node_count(x.as_vec) : val_text(&x).length;
+  push_init(vm, &int_type)->as_int = n;
+  return ret_pc;
+}
+
+struct op *lines_close_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  assert(vm->lines_count);
+  lines_close(vm->lines + --vm->lines_count);
+  return ret_pc;
+}
+
+/* Pushes the next line followed by T, or only F once there are no more lines. */
+
+struct op *lines_next_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  assert(vm->lines_count);
+  struct lines *l = vm->lines + vm->lines_count - 1;
+  bool ok = lines_next(l);
+  if (ok) { push_init(vm, &slice_type)->as_slice = &l->line; }
+  push_init(vm, &bool_type)->as_bool = ok;
+  return ret_pc;
+}
+
+/* Errors are reported at the CALL right before ret_pc. */
+
+struct op *lines_open_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val path = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+  
+  if (path.type != &str_type) {
+    error(vm, pos, "Expected Str: %s", path.type->name);
+    return NULL;
+  }
+
+  if (vm->lines_count == MAX_LINES_COUNT) {
+    error(vm, pos, "Too many lines streams");
+    return NULL;
+  }
+  
+  if (!lines_open(vm->lines + vm->lines_count, path.as_str)) {
+    error(vm, pos, "Failed opening %s: %s", path.as_str, strerror(errno));
+    return NULL;
+  }
+
+  vm->lines_count++;
+  return ret_pc;
+}
+
+struct op *lt_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  slot_t *y = pop_slot(vm);
+  bool res = peek(vm)->as_int < y->as_int;
+  peek_init(vm, &bool_type)->as_bool = res;
+  return ret_pc;
+}
+
+enum emit_res nop_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  return EMIT_OK;
+}
+
+/* Waits while the channel is empty, a full channel wakes its senders once there's room. */
+
+struct op *recv_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val c = pop(vm);
+
+  if (c.type != &chan_type) {
+    error(vm, form_pos(vm, (ret_pc-1)->form), "Expected Chan: %s", c.type->name);
+    return NULL;
+  }
+
+  struct channel *channel = c.as_channel;
+
+  if (!channel_length(channel)) {
+    push(vm, c);
+    return fiber_wait(vm, channel, ret_pc);
+  }
+  
+  if (channel_length(channel) == channel->capacity) { fiber_wake(vm, channel); }
+  push(vm, channel_pop(channel));
+  return ret_pc;
+}
+
+/* Waits while the channel is full, an empty channel wakes its receivers. */
+
+struct op *send_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val val = pop(vm), c = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+
+  if (c.type != &chan_type) {
+    error(vm, pos, "Expected Chan: %s", c.type->name);
+    return NULL;
+  }
+
+  struct channel *channel = c.as_channel;
+  uint32_t n = channel_length(channel);
+  
+  if (n == channel->capacity) {
+    push(vm, c);
+    push(vm, val);
+    return fiber_wait(vm, channel, ret_pc);
+  }
+
+  if (!n) { fiber_wake(vm, channel); }
+  channel_push(channel, val);
+  return ret_pc;
+}
+
+/* Vecs may be set at their length, which appends like push. */
+
+struct op *set_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val val = pop(vm), key = pop(vm), c = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+
+  if (!val_keep(vm, &key) || !val_keep(vm, &val)) {
+    error(vm, pos, "Too many syms");
+    return NULL;
+  }
+
+  if (c.type == &vec_type) {
+    if (key.type != &int_type) {
+      error(vm, pos, "Expected Int: %s", key.type->name);
+      return NULL;
+    }
+    
+    if (key.as_int < 0 || key.as_int > node_count(c.as_vec)) {
+      error(vm, pos, "Index out of bounds: %" PRId32, key.as_int);
+      return NULL;
+    }
+
+    if (!node_reserve(vm, NODE_RESERVE, (struct val[]){c, key, val}, 3) || !(c.as_vec = vec_set(vm, c.as_vec, key.as_int, val))) {
+      error(vm, pos, "Vec overflow");
+      return NULL;
+    }
+  } else if (c.type == &dict_type) {
+    if (!key.type->methods.hash) {
+      error(vm, pos, "Invalid key: %s", key.type->name);
+      return NULL;
+    }
+
+    if (!node_reserve(vm, NODE_RESERVE, (struct val[]){c, key, val}, 3) || !(c.as_dict = dict_set(vm, c.as_dict, key, val))) {
+      error(vm, pos, "Dict overflow");
+      return NULL;
+    }
+  } else {
+    error(vm, pos, "Expected Vec or Dict: %s", c.type->name);
+    return NULL;
+  }
+
+  push(vm, c);
+  return ret_pc;
+}
+
+/* Sleeping for zero lets any other ready fibers run first. */
+
+struct op *sleep_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct val ms = pop(vm);
+  struct pos pos = form_pos(vm, (ret_pc-1)->form);
+  
+  if (ms.type != &int_type || ms.as_int < 0) {
+    error(vm, pos, "Invalid sleep");
+    return NULL;
+  }
+
+  if (!fiber_save(vm, ret_pc, pos)) { return NULL; }
+  struct fiber *f = vm->fiber;
+  
+  if (ms.as_int) {
+    fiber_tick(vm);
+    f->status = FIBER_SLEEPING;
+    timers_add(&vm->timers, &f->timer, now_ms() + ms.as_int);
+  }
+  
+  return fiber_switch(vm, pos);
+}
+
+struct op *sub_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  slot_t *y = pop_slot(vm);
+  peek(vm)->as_int -= y->as_int;
+  return ret_pc;
+}
+
+struct op *vec_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  push_init(vm, &vec_type)->as_vec = NULL;
+  return ret_pc;
+}
+
+bool is_macro(struct vm *vm, form_t form, macro_body_t body) {
+  if (form_type(vm, form) != FORM_ID) { return false; }
+  struct val *v = find(vm, form_id(vm, form));
+  return v && v->type->methods.emit == macro_emit && v->as_macro->body == body;
+}
+
+/* Returns the end of the forms consumed by emitting form, judging from the number of args its binding takes. */
+
+form_t skip_form(struct vm *vm, form_t form, form_t end, struct func *func) {
+  form_t next = vm->forms.ends[form];
+  uint8_t nargs = 0, quoted = 0;
+  
+  if (form_type(vm, form) == FORM_ID) {
+    const char *name = form_id(vm, form);
+    bool is_arg = false;
+    
+    for (struct func_arg *a = func ? func->args : NULL; a && a < func->args + func->nargs; a++) {
+      if (strcmp(a->name, name) == 0) {
+	is_arg = true;
+	break;
+      }
+    }
+
+    struct val *v = is_arg ? NULL : find(vm, name);
+    if (v) { nargs = v->type->methods.nargs(v); }
+    if (v && v->type == &macro_type) { quoted = v->as_macro->quoted; }
+  }
+
+  /* Anonymous funcs are skipped with their args even where a single form is expected. */
+  
+  for (uint8_t i = 0; i < nargs && next < end; i++) {
+    next = ((quoted & (1 << i)) && !is_macro(vm, next, func_body)) ? vm->forms.ends[next] : skip_form(vm, next, end, func);
+  }
+
+  return next;
+}
+
+/* Func and macro definitions and imports push scopes, which sections don't support; 
+   neither do parallel streams, since they add funcs, or macros defined in fibr, since they evaluate code. */
+
+bool has_scope_macro(struct vm *vm, form_t start, form_t end) {
+  for (form_t f = start; f < end; f++) {
+    if (is_macro(vm, f, func_body) || is_macro(vm, f, import_body) ||
+	is_macro(vm, f, macro_body) || is_macro(vm, f, macro_expand_body) ||
+	is_macro(vm, f, pmap_body) || is_macro(vm, f, preduce_body)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*** Streams
+     Streams are fused into a single loop by the fold or sum that consumes them, nothing is ever collected.
+     The loop counts through a range in a register or reads lines, and passes each element through the stages on the stack,
+     filters skip straight to the next element.
+***/
+
+enum stage_type {STAGE_FILTER, STAGE_MAP};
+
+struct stage {
+  enum stage_type type;
+  struct func *func;
+};
+
+struct stream {
+  struct stage stages[MAX_STAGE_COUNT];
+  uint8_t stage_count;
+  bool lines, parallel;
+};
+
+/* Stage funcs are either bound or anonymous, anonymous funcs are pushed at compile time. */
+
+struct func *stage_func(struct vm *vm, form_t form, struct form_range *in, uint8_t nargs) {
+  struct val *v = NULL, anon;
+  
+  if (is_macro(vm, form, func_body)) {
+    if (form_emit(form, in, vm) != EMIT_OK) { return NULL; }
+    anon = pop(vm);
+    v = &anon;
+  } else if (form_type(vm, form) == FORM_ID) {
+    v = find(vm, form_id(vm, form));
+  }
+
+  if (!v || v->type != &func_type || v->as_func->nargs != nargs || v->as_func->nrets != 1) {
+    error(vm, form_pos(vm, form), "Invalid stream func");
+    return NULL;
+  }
+
+  return v->as_func;
+}
+
+/* Collects stages from the outside in and emits the start and end of the range, or the path to read lines from. */
+
+enum emit_res stream_parse(struct stream *self, form_t form, struct form_range *in, struct vm *vm) {
+  if (is_macro(vm, form, filter_body) || is_macro(vm, form, map_body) || is_macro(vm, form, pmap_body)) {
+    if (self->stage_count == MAX_STAGE_COUNT) {
+      error(vm, form_pos(vm, form), "Too many stages");
+      return EMIT_ERROR;
+    }
+
+    struct stage *s = self->stages + self->stage_count++;
+    s->type = is_macro(vm, form, filter_body) ? STAGE_FILTER : STAGE_MAP;
+    self->parallel |= is_macro(vm, form, pmap_body);
+    if (!(s->func = stage_func(vm, pop_form(vm, in), in, 1))) { return EMIT_ERROR; }
+    return stream_parse(self, pop_form(vm, in), in, vm);
+  }
+  
+  if (is_macro(vm, form, range_body)) {
+    for (int i = 0; i < 2; i++) {
+      enum emit_res res = form_emit(pop_form(vm, in), in, vm);
+      if (res != EMIT_OK) { return res; }
+    }
+
+    return EMIT_OK;
+  }
+
+  if (is_macro(vm, form, lines_body)) {
+    self->lines = true;
+    return form_emit(pop_form(vm, in), in, vm);
+  }
+  
+  error(vm, form_pos(vm, form), "Expected stream");
+  return EMIT_ERROR;
+}
+
+void emit_reg(struct vm *vm, enum op_code code, form_t form, reg_t reg) {
+  struct op *op = emit(vm, code, form);
+  if (code == OP_LOAD) { op->as_load.reg = reg; } else { op->as_store.reg = reg; }
+}
+
+/* Emits the loop over the elements of s, folding them into acc using func or summing them if it's NULL. 
+   Expects the range or the lines to be set up already and leaves the result on the stack. */
+
+void stream_loop(struct stream *s, struct func *func, form_t form, struct vm *vm,
+		 reg_t acc, reg_t i, reg_t n, reg_t x) {
+  struct op *start_pc = pc(vm);
+  struct op_branch *done = NULL;
+  
+  if (s->lines) {
+    emit(vm, OP_CALL, form)->as_call.func = &lines_next_func;
+    done = &emit(vm, OP_BRANCH, form)->as_branch;
+  } else {
+    emit_reg(vm, OP_STORE, form, i);
+    emit_reg(vm, OP_STORE, form, n);
+    emit(vm, OP_CALL, form)->as_call.func = &lt_func;
+    done = &emit(vm, OP_BRANCH, form)->as_branch;
+    emit_reg(vm, OP_STORE, form, i);
+  }
+
+  struct op_branch *skips[MAX_STAGE_COUNT];
+  uint8_t skip_count = 0;
+  
+  for (struct stage *st = s->stages + s->stage_count - 1; st >= s->stages; st--) {
+    if (st->type == STAGE_FILTER) {
+      emit_reg(vm, OP_LOAD, form, x);
+      emit_reg(vm, OP_STORE, form, x);
+      emit(vm, OP_CALL, form)->as_call.func = st->func;
+      skips[skip_count++] = &emit(vm, OP_BRANCH, form)->as_branch;
+      emit_reg(vm, OP_STORE, form, x);
+    } else {
+      emit(vm, OP_CALL, form)->as_call.func = st->func;
+    }
+  }
+
+  if (func) {
+    emit_reg(vm, OP_LOAD, form, x);
+    emit_reg(vm, OP_STORE, form, acc);
+    emit_reg(vm, OP_STORE, form, x);
+  } else {
+    emit_reg(vm, OP_STORE, form, acc);
+  }
+
+  emit(vm, OP_CALL, form)->as_call.func = func ? func : &add_func;
+  emit_reg(vm, OP_LOAD, form, acc);
+  for (uint8_t j = 0; j < skip_count; j++) { skips[j]->false_pc = pc(vm); }
+
+  if (!s->lines) {
+    emit_reg(vm, OP_STORE, form, i);
+    val_init(&emit(vm, OP_PUSH, form)->as_push.val, &int_type)->as_int = 1;
+    emit(vm, OP_CALL, form)->as_call.func = &add_func;
+    emit_reg(vm, OP_LOAD, form, i);
+  }
+  
+  emit(vm, OP_JUMP, form)->as_jump.pc = start_pc;
+  done->false_pc = pc(vm);
+  if (s->lines) { emit(vm, OP_CALL, form)->as_call.func = &lines_close_func; }
+  emit_reg(vm, OP_STORE, form, acc);
+}
+
+/* Parallel streams compile the loop into a func that folds a chunk of the range starting from the initial value,
+   which pfold calls on separate threads before combining the results. */
+
+enum emit_res stream_pfold(struct stream *s, struct func *func, form_t form, struct vm *vm) {
+  if (s->lines) {
+    error(vm, form_pos(vm, form), "Parallel streams need a range");
+    return EMIT_ERROR;
+  }
+
+  if (vm->func_count == MAX_FUNC_COUNT) {
+    error(vm, form_pos(vm, form), "Too many funcs");
+    return EMIT_ERROR;
+  }
+  
+  struct func *chunk = func_init(vm->funcs + vm->func_count++, "pfold",
+				 3, (struct func_arg[]){arg("start", &int_type), arg("end", &int_type), arg("init", NULL)},
+				 1, (struct type *[]){NULL},
+				 __func_body);
+
+  struct op_jump *skip = &emit(vm, OP_JUMP, form)->as_jump;
+  chunk->start_pc = pc(vm);
+  stream_loop(s, func, form, vm, 2, 0, 1, 3);
+  emit(vm, OP_RET, form)->as_ret.func = chunk;
+  skip->pc = pc(vm);
+  
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &func_type)->as_func = chunk;
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &func_type)->as_func = func ? func : &add_func;
+  emit(vm, OP_CALL, form)->as_call.func = &pfold_func;
+  return EMIT_OK;
+}
+
+/* Expects the initial value on the stack followed by the parsed stream. */
+
+enum emit_res stream_reduce(struct stream *s, struct func *func, bool parallel, form_t form, struct vm *vm) {
+  if (s->parallel && func && !parallel) {
+    error(vm, form_pos(vm, form), "Parallel streams need sum or preduce");
+    return EMIT_ERROR;
+  }
+  
+  if (s->parallel || parallel) { return stream_pfold(s, func, form, vm); }
+  struct scope *sc = peek_scope(vm);
+
+  if (sc->reg_count + 4 > MAX_REG_COUNT) {
+    error(vm, form_pos(vm, form), "Too many registers");
+    return EMIT_ERROR;
+  }
+
+  reg_t acc = sc->reg_count, i = acc+1, n = acc+2, x = acc+3;
+  sc->reg_count += 4;
+
+  if (s->lines) {
+    emit(vm, OP_CALL, form)->as_call.func = &lines_open_func;
+  } else {
+    emit_reg(vm, OP_LOAD, form, n);
+    emit_reg(vm, OP_LOAD, form, i);
+  }
+  
+  emit_reg(vm, OP_LOAD, form, acc);
+  stream_loop(s, func, form, vm, acc, i, n, x);
+  sc->reg_count -= 4;
+  return EMIT_OK;
+}
+
+/* Expects the initial value on the stack followed by the stream. */
+
+enum emit_res stream_fold(struct func *func, bool parallel, form_t form, struct form_range *in, struct vm *vm) {
+  struct stream s;
+  s.stage_count = 0;
+  s.lines = s.parallel = false;
+  enum emit_res res = stream_parse(&s, pop_form(vm, in), in, vm);
+  if (res != EMIT_OK) { return res; }
+  return stream_reduce(&s, func, parallel, form, vm);
+}
+
+/* Chunks are folded by workers cloned from the VM that called pfold, which is frozen meanwhile. 
+   There is one set of workers per process, pfold folds everything itself when it's busy. */
+
+struct chunk {
+  struct vm *vm;
+  struct func *func;
+  form_t form;
+  struct val start, end, init, result;
+  enum eval_res res;
+  pthread_t thread;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct vm vms[MAX_WORKER_COUNT];
+} chunk_workers = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void *chunk_run(void *arg) {
+  struct chunk *self = arg;
+  push(self->vm, self->start);
+  push(self->vm, self->end);
+  push(self->vm, self->init);
+  self->res = eval_call(self->vm, self->func, self->form);
+  if (self->res == EVAL_OK) { self->result = pop(self->vm); }
+  return NULL;
+}
+
+struct op *pfold_body(struct func *self, struct op *ret_pc, struct vm *vm) {
+  struct func *combine = pop(vm).as_func, *func = pop(vm).as_func;
+  struct val end = pop(vm), start = pop(vm), init = pop(vm);
+
+  if (start.type != &int_type || end.type != &int_type) {
+    error(vm, form_pos(vm, (ret_pc-1)->form), "Invalid range");
+    return NULL;
+  }
+
+  int64_t count = (int64_t)end.as_int - start.as_int;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t chunk_count = (ncpus > 0 && ncpus < MAX_WORKER_COUNT) ? ncpus : MAX_WORKER_COUNT;
+  if (count < chunk_count) { chunk_count = (count > 0) ? count : 1; }
+  bool pooled = chunk_count > 1 && pthread_mutex_trylock(&chunk_workers.lock) == 0;
+  if (!pooled) { chunk_count = 1; }
+  bool frozen = vm->frozen;
+  if (pooled) { vm_snapshot(vm); }
+  struct chunk chunks[MAX_WORKER_COUNT];
+  bool started[MAX_WORKER_COUNT] = {false};
+  
+  for (uint32_t i = 0; i < chunk_count; i++) {
+    struct chunk *c = chunks + i;
+    c->vm = vm;
+    c->func = func;
+    c->form = (ret_pc-1)->form;
+    val_init(&c->start, &int_type)->as_int = start.as_int + count * i / chunk_count;
+    val_init(&c->end, &int_type)->as_int = (i == chunk_count-1) ? end.as_int : start.as_int + count * (i+1) / chunk_count;
+    c->init = init;
+
+    if (pooled) {
+      c->vm = vm_clone(chunk_workers.vms + i, vm);
+      push_state(c->vm);
+      started[i] = pthread_create(&c->thread, NULL, chunk_run, c) == 0;
+    }
+
+    /* Chunks that didn't get a thread are folded inline. */
+    
+    if (!started[i]) { chunk_run(c); }
+  }
+
+  if (pooled) {
+    for (uint32_t i = 0; i < chunk_count; i++) {
+      if (started[i]) { pthread_join(chunks[i].thread, NULL); }
+    }
+    
+    vm->frozen = frozen;
+  }
+
+  uint32_t size = 0;
+  
+  for (struct chunk *c = chunks; c < chunks + chunk_count; c++) {
+    if (c->res != EVAL_OK) {
+      if (c->vm != vm) { strcpy(vm->error, c->vm->error); }
+      if (pooled) { pthread_mutex_unlock(&chunk_workers.lock); }
+      return NULL;
+    }
+
+    if (c->vm != vm) { size += val_size(c->vm, &c->result); }
+  }
+
+  /* Results are copied out of the workers' pools before they're released, and pinned while they're combined. */
+  
+  if (!node_reserve(vm, size, NULL, 0)) {
+    error(vm, form_pos(vm, (ret_pc-1)->form), "Out of nodes");
+    if (pooled) { pthread_mutex_unlock(&chunk_workers.lock); }
+    return NULL;
+  }
+  
+  struct val results[MAX_WORKER_COUNT];
+
+  for (uint32_t i = 0; i < chunk_count; i++) {
+    results[i] = chunks[i].result;
+    if (chunks[i].vm != vm) { val_adopt(vm, chunks[i].vm, results+i); }
+  }
+  
+  if (pooled) { pthread_mutex_unlock(&chunk_workers.lock); }
+  struct pin pin;
+  pin_init(&pin, vm, results, chunk_count);
+
+  for (uint32_t i = 1; i < chunk_count; i++) {
+    push(vm, results[0]);
+    push(vm, results[i]);
+
+    if (eval_call(vm, combine, (ret_pc-1)->form) != EVAL_OK) {
+      unpin(vm, &pin);
+      return NULL;
+    }
+    
+    results[0] = pop(vm);
+  }
+
+  unpin(vm, &pin);
+  push(vm, results[0]);
+  return ret_pc;
+}
+
+/* Stages are only valid as part of a stream consumed by fold, preduce or sum. */
+
+enum emit_res stage_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  error(vm, form_pos(vm, form), "Unconsumed stream: %s", self->name);
+  return EMIT_ERROR;
+}
+
+/* Collects the stream into a Vec, mapping a range through a func from Int to Int is evaluated in batches. */
+
+enum emit_res collect_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &vec_type)->as_vec = NULL;
+  struct stream s;
+  s.stage_count = 0;
+  s.lines = s.parallel = false;
+  enum emit_res res = stream_parse(&s, pop_form(vm, in), in, vm);
+  if (res != EMIT_OK) { return res; }
+  struct stage *st = s.stages;
+  
+  if (!s.lines && !s.parallel && s.stage_count == 1 && st->type == STAGE_MAP &&
+      st->func->args[0].type == &int_type && st->func->rets[0] == &int_type) {
+    val_init(&emit(vm, OP_PUSH, form)->as_push.val, &func_type)->as_func = st->func;
+    emit(vm, OP_CALL, form)->as_call.func = &batch_map_func;
+    return EMIT_OK;
+  }
+  
+  return stream_reduce(&s, &push_func, false, form, vm);
+}
+
+enum emit_res filter_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  return stage_body(self, form, in, vm);
+}
+
+enum emit_res fold_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  struct func *func = stage_func(vm, pop_form(vm, in), in, 2);
+  if (!func) { return EMIT_ERROR; }
+  enum emit_res res = form_emit(pop_form(vm, in), in, vm);
+  if (res != EMIT_OK) { return res; }
+  return stream_fold(func, false, form, in, vm);
+}
+
+enum emit_res lines_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  return stage_body(self, form, in, vm);
+}
+
+enum emit_res map_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  return stage_body(self, form, in, vm);
+}
+
+enum emit_res pmap_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  return stage_body(self, form, in, vm);
+}
+
+/* Folds in parallel, which requires func to be associative with the initial value as identity. */
+
+enum emit_res preduce_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  struct func *func = stage_func(vm, pop_form(vm, in), in, 2);
+  if (!func) { return EMIT_ERROR; }
+  enum emit_res res = form_emit(pop_form(vm, in), in, vm);
+  if (res != EMIT_OK) { return res; }
+  return stream_fold(func, true, form, in, vm);
+}
+
+enum emit_res range_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  return stage_body(self, form, in, vm);
+}
+
+enum emit_res sum_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  val_init(&emit(vm, OP_PUSH, form)->as_push.val, &int_type)->as_int = 0;
+  return stream_fold(NULL, false, form, in, vm);
+}
+
+struct section *section_init(struct section *self, struct vm *vm, uint32_t def_start, uint32_t index, uint32_t stride) {
+  self->vm = vm;
+  self->def_start = def_start;
+  self->index = index;
+  self->stride = stride;
+  self->op_count = 0;
+  self->ops_full = false;
+  self->scope.parent_scope = peek_scope(vm);
+  self->res = EMIT_OK;
+  *self->error = 0;
+  return self;
+}
+
+/* Emits every stride:th parallel def, starting from the section's index. */
+
+void *section_emit(void *arg) {
+  struct section *self = arg;
+  struct vm *vm = self->vm;
+  emit_section = self;
+  uint32_t i = 0;
+  
+  for (struct func_def *d = vm->defs + self->def_start; d < vm->defs + vm->def_count && self->res == EMIT_OK; d++) {
+    if (!d->parallel || i++ % self->stride != self->index) { continue; }
+    d->section = self;
+    d->start = self->op_count;
+    scope_init(&self->scope, vm);
+    self->res = bind_args(vm, d->func, d->form);
+    struct form_range body;
+    form_range_init(&body, d->body, d->end);
+    
+    while (self->res == EMIT_OK && !form_range_null(&body)) {
+      form_t f = pop_form(vm, &body);
+      self->res = form_emit(f, &body, vm);
+    }
+
+    emit_ret(vm, d->func, self->ops + d->start, d->body);
+    if (self->res == EMIT_OK && emit_full(vm, d->form)) { self->res = EMIT_ERROR; }
+  }
+
+  emit_section = NULL;
+  return NULL;
+}
+
+void section_link(struct section *self) {
+  struct vm *vm = self->vm;
+  assert(vm->op_count + self->op_count <= MAX_OP_COUNT);
+  struct op *start = vm->ops + vm->op_count;
+  memcpy(start, self->ops, self->op_count * sizeof(struct op));
+  
+  for (struct op *op = start; op < start + self->op_count; op++) {
+    op_move(op, self->ops, start);
+  }
+
+  vm->op_count += self->op_count;
+
+  for (struct func_def *d = vm->defs + self->def_start; d < vm->defs + vm->def_count; d++) {
+    if (d->section == self) { d->func->start_pc = start + d->start; }
+  }
+}
+
+/* Registers all top level func definitions up front so they may refer to each other in any order,
+   bodies that don't define funcs of their own are then compiled in parallel and linked in front of the remaining code.
+   Defs are appended from def_start, since imports emit modules while the importing forms are being emitted.
+   Imports and macro definitions bind while emitting, defs following them are compiled in order. */
+
+enum emit_res emit_defs(struct vm *vm, struct form_range *in, uint32_t def_start) {
+  for (form_t f = in->start; f < in->end; f = vm->forms.ends[f]) {
+    if (!is_macro(vm, f, func_body)) { continue; }
+    struct form_range r;
+    form_range_init(&r, vm->forms.ends[f], in->end);
+    form_t fs[4];
+    uint8_t n = 0;
+    for (; n < 4 && !form_range_null(&r); n++) { fs[n] = pop_form(vm, &r); }
+    
+    if (n < 4 || form_type(vm, fs[0]) != FORM_ID || strcmp(form_id(vm, fs[0]), "_") == 0) {
+      continue;
+    }
+
+    if (vm->def_count == MAX_FUNC_COUNT) {
+      error(vm, form_pos(vm, fs[0]), "Too many funcs");
+      return EMIT_ERROR;
+    }
+    
+    struct func *func = new_func(vm, fs[0], fs[1], fs[2]);
+    if (!func || bind_func(vm, func, fs[0]) != EMIT_OK) { return EMIT_ERROR; }
+    struct func_def *d = vm->defs + vm->def_count++;
+    d->func = func;
+    d->form = f;
+    d->body = fs[3];
+    d->end = FORM_NULL;
+    d->parallel = false;
+    d->section = NULL;
+  }
+
+  uint32_t nparallel = 0;
+  bool late_bindings = false;
+  
+  for (form_t f = in->start; f < in->end;) {
+    struct func_def *d = find_def(vm, f);
+
+    if (d) {
+      d->end = skip_form(vm, d->body, in->end, d->func);
+      d->parallel = !late_bindings && !has_scope_macro(vm, d->body, d->end);
+      if (d->parallel) { nparallel++; }
+      f = d->end;
+    } else {
+      late_bindings |= is_macro(vm, f, import_body) || is_macro(vm, f, macro_body);
+      f = skip_form(vm, f, in->end, NULL);
+    }
+  }
+
+  if (!nparallel) { return EMIT_OK; }
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t nsections = nparallel;
+  if (ncpus > 0 && nsections > ncpus) { nsections = ncpus; }
+  if (nsections > MAX_SECTION_COUNT) { nsections = MAX_SECTION_COUNT; }
+  pthread_t threads[MAX_SECTION_COUNT];
+  bool started[MAX_SECTION_COUNT] = {false};
+  
+  for (uint32_t i = 0; i < nsections; i++) {
+    section_init(vm->sections + i, vm, def_start, i, nsections);
+  }
+
+  for (uint32_t i = 1; i < nsections; i++) {
+    started[i] = pthread_create(threads + i, NULL, section_emit, vm->sections + i) == 0;
+  }
+
+  for (uint32_t i = 0; i < nsections; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      section_emit(vm->sections + i);
+    }
+  }
+
+  for (struct section *s = vm->sections; s < vm->sections + nsections; s++) {
+    if (s->res != EMIT_OK) {
+      strcpy(vm->error, s->error);
+      return s->res;
+    }
+  }
+
+  uint32_t op_count = vm->op_count + 1;
+  for (struct section *s = vm->sections; s < vm->sections + nsections; s++) { op_count += s->op_count; }
+
+  if (op_count > MAX_OP_COUNT) {
+    error(vm, form_pos(vm, in->start), "Too many ops");
+    return EMIT_ERROR;
+  }
+  
+  struct op_jump *skip = &emit(vm, OP_JUMP, in->start)->as_jump;
+  
+  for (struct section *s = vm->sections; s < vm->sections + nsections; s++) {
+    section_link(s);
+  }
+
+  skip->pc = pc(vm);
+  return EMIT_OK;
+}
+
+enum emit_res emit_forms(struct vm *vm, struct form_range *in) {
+  PROBE(emit_start, vm->op_count);
+  uint32_t def_start = vm->def_count;
+  enum emit_res res = emit_defs(vm, in, def_start);
+  
+  while (res == EMIT_OK && !form_range_null(in)) {
+    form_t f = pop_form(vm, in);
+    struct func_def *d = find_def(vm, f);
+    
+    if (d && d->parallel) {
+      in->start = d->end;
+    } else {
+      res = form_emit(f, in, vm);
+      if (res == EMIT_OK && emit_full(vm, f)) { res = EMIT_ERROR; }
+    }
+  }
+
+  vm->def_count = def_start;
+  PROBE(emit_end, res, vm->op_count);
+  return res;
+}
+
+/*** Layout
+     Code is laid out once it's compiled, before it runs.
+     Func bodies are moved from where they were defined to the end, one after the other,
+     which leaves the jumps around them pointing at the next op; such jumps are dropped.
+     Bodies stay contiguous from start_pc to RET, which is what the vector evaluator expects.
+***/
+
+struct layout_chunk {
+  uint32_t start, end;
+};
+
+struct layout {
+  struct op *ops;
+  uint32_t op_count;
+  bool starts[MAX_OP_COUNT], dropped[MAX_OP_COUNT];
+  uint32_t order[MAX_OP_COUNT], order_count;
+  uint32_t index[MAX_OP_COUNT+1];
+  struct layout_chunk chunks[MAX_FUNC_COUNT];
+  uint32_t chunk_count;
+};
+
+/* Appends ops in the range to the order, bodies that are jumped over are queued. */
+
+void layout_place(struct layout *self, uint32_t start, uint32_t end) {
+  for (uint32_t i = start; i < end; i++) {
+    struct op *op = self->ops + i;
+    self->order[self->order_count++] = i;
+    if (op->code != OP_JUMP) { continue; }
+    uint32_t t = op->as_jump.pc - self->ops;
+    
+    if (t > i+1 && self->starts[i+1]) {
+      assert(self->chunk_count < MAX_FUNC_COUNT);
+      self->chunks[self->chunk_count++] = (struct layout_chunk){i+1, t};
+      i = t-1;
+    }
+  }
+}
+
+/* Follows dropped jumps to the op that runs in their place. */
+
+uint32_t layout_resolve(struct layout *self, uint32_t i) {
+  while (i < self->op_count && self->dropped[i]) { i = self->ops[i].as_jump.pc - self->ops; }
+  return i;
+}
+
+struct op *layout_pc(struct layout *self, struct op *pc) {
+  assert(pc >= self->ops && pc <= self->ops + self->op_count);
+  return self->ops + self->index[pc - self->ops];
+}
+
+/* Lays out ops from start to the current pc, which has to end with an op that doesn't fall through. */
+
+void layout(struct vm *vm, struct op *start) {
+  static _Thread_local struct layout l;
+  static _Thread_local struct op ops[MAX_OP_COUNT];
+  l.ops = start;
+  l.op_count = pc(vm) - start;
+  l.order_count = l.chunk_count = 0;
+  memset(l.starts, 0, l.op_count * sizeof(bool));
+  memset(l.dropped, 0, l.op_count * sizeof(bool));
+
+  for (struct func *f = vm->funcs; f < vm->funcs + vm->func_count; f++) {
+    if (f->start_pc >= start && f->start_pc < start + l.op_count) { l.starts[f->start_pc - start] = true; }
+  }
+
+  layout_place(&l, 0, l.op_count);
+  
+  for (struct layout_chunk *c = l.chunks; c < l.chunks + l.chunk_count; c++) {
+    layout_place(&l, c->start, c->end);
+  }
+
+  assert(l.order_count == l.op_count);
+  uint32_t next = l.op_count;
+  
+  for (uint32_t *i = l.order + l.order_count; i > l.order;) {
+    struct op *op = l.ops + *--i;
+    
+    if (op->code == OP_JUMP && layout_resolve(&l, op->as_jump.pc - l.ops) == next) {
+      l.dropped[*i] = true;
+    } else {
+      next = *i;
+    }
+  }
+
+  uint32_t n = 0;
+  
+  for (uint32_t *i = l.order; i < l.order + l.order_count; i++) {
+    if (!l.dropped[*i]) { ops[l.index[*i] = n++] = l.ops[*i]; }
+  }
+
+  l.index[l.op_count] = n;
+  
+  for (uint32_t i = 0; i < l.op_count; i++) {
+    if (l.dropped[i]) { l.index[i] = l.index[layout_resolve(&l, i)]; }
+  }
+
+  for (struct op *op = ops; op < ops + n; op++) {
+    switch (op->code) {
+    case OP_BRANCH:
+      op->as_branch.false_pc = layout_pc(&l, op->as_branch.false_pc);
+      break;
+    case OP_JUMP:
+      op->as_jump.pc = layout_pc(&l, op->as_jump.pc);
+      break;
+    default:
+      break;
+    }
+  }
+
+  for (struct func *f = vm->funcs; f < vm->funcs + vm->func_count; f++) {
+    if (f->start_pc >= start && f->start_pc < start + l.op_count) { f->start_pc = layout_pc(&l, f->start_pc); }
+  }
+  
+  memcpy(start, ops, n * sizeof(struct op));
+  vm->op_count -= l.op_count - n;
+}
+
+enum eval_res eval_forms(struct vm *vm, struct form_range *forms) {
+  if (form_range_null(forms)) { return EVAL_OK; }
+  form_t start = forms->start;
+  struct op *start_pc = pc(vm);
+  vm->ops_full = false;
+  if (emit_forms(vm, forms) != EMIT_OK) { return EVAL_ERROR; }
+  emit(vm, OP_STOP, FORM_NULL);
+  if (emit_full(vm, start)) { return EVAL_ERROR; }
+  layout(vm, start_pc);
+  return eval(vm, start_pc);
 }
 
-struct val *bind_init(struct vm *vm, const char *name, struct type *type) {
-  return val_init(bind(vm, name), type);
+/*** Modules
+     Modules are imported once per VM, the first import compiles the module into a func that runs its top level code
+     and binds whatever the module bound in its own scope, later imports only bind.
+
+     Compiled modules are cached next to their source as images of their ops,
+     modules imported for the first time while compiling are part of the image and checked against their sources when loading.
+     Pointers are written as indexes into the image or as names of builtins, and resolved when loading;
+     modules that refer to anything else are simply not cached.
+***/
+
+struct module *find_module(struct vm *vm, struct stat *st) {
+  for (; vm; vm = vm->snapshot) {
+    for (struct module *m = vm->modules; m < vm->modules + vm->module_count; m++) {
+      if (m->dev == st->st_dev && m->ino == st->st_ino) { return m; }
+    }
+  }
+  
+  return NULL;
 }
 
-struct val *find(struct vm *vm, const char *name) {
-  struct scope *scope = peek_scope(vm);
-  return env_get(&scope->bindings, name);
+struct image_header {
+  char magic[4];
+  uint32_t version, module_count, func_count, op_count;
+};
+
+struct image_source {
+  int64_t mtime, mtime_nsec, size;
+};
+
+struct image {
+  struct vm *vm;
+  FILE *file;
+  struct module *modules;
+  uint32_t module_count;
+  struct func *funcs;
+  uint32_t func_count;
+  struct op *ops;
+  uint32_t op_count;
+  bool ok;
+};
+
+struct image *image_init(struct image *self, struct vm *vm, FILE *file,
+			 struct module *modules, uint32_t module_count,
+			 struct func *funcs, uint32_t func_count,
+			 struct op *ops, uint32_t op_count) {
+  self->vm = vm;
+  self->file = file;
+  self->modules = modules;
+  self->module_count = module_count;
+  self->funcs = funcs;
+  self->func_count = func_count;
+  self->ops = ops;
+  self->op_count = op_count;
+  self->ok = true;
+  return self;
 }
 
-struct state *push_state(struct vm *vm) {
-  assert(vm->state_count < MAX_STATE_COUNT);
-  return state_init(vm->states+vm->state_count++);
+struct image_header *image_header_init(struct image_header *self,
+				       uint32_t module_count, uint32_t func_count, uint32_t op_count) {
+  memset(self, 0, sizeof(struct image_header));
+  memcpy(self->magic, "fibr", sizeof(self->magic));
+  self->version = VERSION;
+  self->module_count = module_count;
+  self->func_count = func_count;
+  self->op_count = op_count;
+  return self;
 }
-			 
-struct state *peek_state(struct vm *vm) {
-  assert(vm->state_count);
-  return vm->states+vm->state_count-1;
+
+struct image_source *image_source_init(struct image_source *self, struct stat *st) {
+  memset(self, 0, sizeof(struct image_source));
+  self->mtime = st->st_mtim.tv_sec;
+  self->mtime_nsec = st->st_mtim.tv_nsec;
+  self->size = st->st_size;
+  return self;
 }
 
-struct state *pop_state(struct vm *vm) {
-  assert(vm->state_count);
-  return vm->states + --vm->state_count;
+void image_write(struct image *self, const void *data, size_t size) {
+  if (self->ok && size && fwrite(data, size, 1, self->file) != 1) { self->ok = false; }
 }
 
-struct frame *push_frame(struct vm *vm, struct func *func, struct op *ret_pc) {
-  push_state(vm);
-  assert(vm->frame_count < MAX_FRAME_COUNT);
-  return frame_init(vm->frames+vm->frame_count++, func, ret_pc);
+void image_read(struct image *self, void *data, size_t size) {
+  if (self->ok && size && fread(data, size, 1, self->file) != 1) { self->ok = false; }
 }
-			 
-struct frame *peek_frame(struct vm *vm) {
-  assert(vm->frame_count);
-  return vm->frames+vm->frame_count-1;
+
+void image_write_name(struct image *self, const char *name) {
+  uint8_t n = strlen(name);
+  image_write(self, &n, sizeof(n));
+  image_write(self, name, n);
 }
 
-struct frame *pop_frame(struct vm *vm) {
-  assert(vm->frame_count);
-  pop_state(vm);
-  return vm->frames + --vm->frame_count;
+bool image_read_name(struct image *self, char *name, size_t max) {
+  uint8_t n = 0;
+  image_read(self, &n, sizeof(n));
+  if (n >= max) { self->ok = false; }
+  image_read(self, name, n);
+  name[self->ok ? n : 0] = 0;
+  return self->ok;
 }
 
-struct op *emit(struct vm *vm, enum op_code code, struct form *form) {
-  assert(vm->op_count < MAX_OP_COUNT);
-  struct op *op = op_init(vm->ops + vm->op_count++, code, form);
-  return op;
+struct val *builtin_binding(const char *name, struct type *type) {
+  struct val *v = find_builtin(name);
+  return (v && v->type == type) ? v : NULL;
 }
 
-struct op *pc(struct vm *vm) {
-  return vm->ops + vm->op_count;
+void image_write_type(struct image *self, struct type *type) {
+  if (!type) {
+    image_write_name(self, "");
+    return;
+  }
+  
+  struct val *v = builtin_binding(type->name, &meta_type);
+  if (!v || v->as_meta != type) { self->ok = false; }
+  image_write_name(self, type->name);
 }
 
-struct val *reg(struct vm *vm, reg_t reg) {
-  assert(reg < MAX_REG_COUNT);
-  return peek_state(vm)->regs+reg;
+struct type *image_read_type(struct image *self) {
+  char name[MAX_NAME_LENGTH];
+  if (!image_read_name(self, name, MAX_NAME_LENGTH) || !*name) { return NULL; }
+  struct val *v = builtin_binding(name, &meta_type);
+  if (!v) { self->ok = false; }
+  return v ? v->as_meta : NULL;
 }
 
-struct val *push(struct vm *vm) {
-  struct state *s = peek_state(vm);
-  return s->stack+s->stack_size++;
+void image_write_func(struct image *self, struct func *func) {
+  uint8_t local = func >= self->funcs && func < self->funcs + self->func_count;
+  image_write(self, &local, sizeof(local));
+  
+  if (local) {
+    uint16_t i = func - self->funcs;
+    image_write(self, &i, sizeof(i));
+    return;
+  }
+
+  struct val *v = builtin_binding(func->name, &func_type);
+  if (!v || v->as_func != func) { self->ok = false; }
+  image_write_name(self, func->name);
 }
 
-struct val *push_init(struct vm *vm, struct type *type) {
-  struct state *s = peek_state(vm);
-  return val_init(s->stack+s->stack_size++, type);
+struct func *image_read_func(struct image *self) {
+  uint8_t local = 0;
+  image_read(self, &local, sizeof(local));
+
+  if (local) {
+    uint16_t i = 0;
+    image_read(self, &i, sizeof(i));
+    if (i >= self->func_count) { self->ok = false; }
+    return self->ok ? self->funcs + i : NULL;
+  }
+
+  char name[MAX_NAME_LENGTH];
+  if (!image_read_name(self, name, MAX_NAME_LENGTH)) { return NULL; }
+  struct val *v = builtin_binding(name, &func_type);
+  if (!v) { self->ok = false; }
+  return v ? v->as_func : NULL;
 }
 
-struct val *peek(struct vm *vm) {
-  struct state *s = peek_state(vm);
-  assert(s->stack_size);
-  return s->stack+s->stack_size-1;
+void image_write_pc(struct image *self, struct op *pc) {
+  uint32_t i = pc - self->ops;
+  if (pc < self->ops || i > self->op_count) { self->ok = false; }
+  image_write(self, &i, sizeof(i));
 }
 
-struct val *pop(struct vm *vm) {
-  struct state *s = peek_state(vm);
-  assert(s->stack_size);
-  return s->stack + --s->stack_size;
+struct op *image_read_pc(struct image *self) {
+  uint32_t i = 0;
+  image_read(self, &i, sizeof(i));
+  if (i > self->op_count) { self->ok = false; }
+  return self->ops + i;
 }
 
-void dump_stack(struct vm *vm, FILE *out) {
-  fputc('[', out);
-  struct state *s = peek_state(vm);
+void image_write_val(struct image *self, struct val *val) {
+  image_write_type(self, val->type);
   
-  for (struct val *v = s->stack; v < s->stack + s->stack_size; v++) {
-    if (v > s->stack) { fputc(' ', out); }
-    val_dump(v, out);
+  if (!val->type) {
+    return;
+  } else if (val->type == &bool_type) {
+    uint8_t b = val->as_bool;
+    image_write(self, &b, sizeof(b));
+  } else if (val->type == &func_type) {
+    image_write_func(self, val->as_func);
+  } else if (val->type == &int_type) {
+    image_write(self, &val->as_int, sizeof(val->as_int));
+  } else if (val->type == &meta_type) {
+    image_write_type(self, val->as_meta);
+  } else if (val->type == &reg_type) {
+    image_write(self, &val->as_reg, sizeof(val->as_reg));
+  } else if (val->type == &str_type) {
+    size_t n = strlen(val->as_str);
+    if (n > UINT16_MAX) { self->ok = false; }
+    uint16_t sn = n;
+    image_write(self, &sn, sizeof(sn));
+    image_write(self, val->as_str, sn);
+  } else {
+    self->ok = false;
   }
-
-  fputc(']', out);
 }
 
-struct scope *scope_init(struct scope *self, struct vm *vm) {
-  env_init(&self->bindings);
-  self->reg_count = self->parent_scope ? self->parent_scope->reg_count : 0;
-  return self;
+struct val *image_read_val(struct image *self, struct val *val) {
+  struct vm *vm = self->vm;
+  val->type = image_read_type(self);
+  
+  if (!val->type) {
+    return val;
+  } else if (val->type == &bool_type) {
+    uint8_t b = 0;
+    image_read(self, &b, sizeof(b));
+    val->as_bool = b;
+  } else if (val->type == &func_type) {
+    val->as_func = image_read_func(self);
+  } else if (val->type == &int_type) {
+    image_read(self, &val->as_int, sizeof(val->as_int));
+  } else if (val->type == &meta_type) {
+    val->as_meta = image_read_type(self);
+  } else if (val->type == &reg_type) {
+    image_read(self, &val->as_reg, sizeof(val->as_reg));
+  } else if (val->type == &str_type) {
+    uint16_t n = 0;
+    image_read(self, &n, sizeof(n));
+    char s[UINT16_MAX];
+    image_read(self, s, n);
+    sym_t sn = self->ok ? sym(&vm->syms, s, n) : SYM_NULL;
+    
+    if (sn == SYM_NULL) {
+      self->ok = false;
+    } else {
+      val->as_str = sym_name(&vm->syms, sn);
+    }
+  } else {
+    self->ok = false;
+  }
+
+  return val;
 }
 
-#define DISPATCH(next_op)						\
-  if (vm->debug) { op_dump(next_op, stdout); fputc('\n', stdout); }	\
-  goto *dispatch[(op = next_op)->code]
+void image_write_op(struct image *self, struct op *op) {
+  uint8_t code = op->code;
+  image_write(self, &code, sizeof(code));
+  struct pos pos = form_pos(self->vm, op->form);
+  uint16_t source = 0;
+  while (source < self->module_count && self->modules[source].source != pos.source) { source++; }
+  if (source == self->module_count) { self->ok = false; }
+  image_write(self, &source, sizeof(source));
+  image_write(self, &pos.line, sizeof(pos.line));
+  image_write(self, &pos.column, sizeof(pos.column));
   
-enum eval_res eval(struct vm *vm, struct op *start_pc) {
-  static const void* dispatch[] = {
-    &&BRANCH, &&CALL, &&DROP, &&EQUAL, &&JUMP, &&LOAD, &&NOP, &&PUSH, &&RET, &&STORE,
+  switch (op->code) {
+  case OP_BRANCH:
+    image_write_pc(self, op->as_branch.false_pc);
+    break;
+  case OP_CALL:
+    image_write_func(self, op->as_call.func);
+    break;
+  case OP_DROP:
+    image_write(self, &op->as_drop.count, sizeof(op->as_drop.count));
+    break;
+  case OP_EQUAL:
+    image_write_val(self, &op->as_equal.x);
+    image_write_val(self, &op->as_equal.y);
+    break;
+  case OP_JUMP:
+    image_write_pc(self, op->as_jump.pc);
+    break;
+  case OP_LOAD:
+    image_write(self, &op->as_load.reg, sizeof(op->as_load.reg));
+    break;
+  case OP_NOP:
+    break;
+  case OP_PUSH:
+    image_write_val(self, &op->as_push.val);
+    break;
+  case OP_RET:
+    image_write_func(self, op->as_ret.func);
+    image_write(self, &op->as_ret.check, sizeof(op->as_ret.check));
+    break;
+  case OP_STORE:
+    image_write(self, &op->as_store.reg, sizeof(op->as_store.reg));
+    break;
     //---STOP---
-    &&STOP};
+  case OP_STOP:
+    self->ok = false;
+    break;
+  }
+}
 
-  struct op *op = start_pc;
-  DISPATCH(op);
+/* Cached ops carry their positions in forms of their own, semis being the only forms that carry nothing else. */
 
- BRANCH: {
-    struct op_branch *branch = &op->as_branch;
-    DISPATCH(val_true(pop(vm)) ? op+1 : branch->false_pc);
+struct op *image_read_op(struct image *self, struct op *op) {
+  uint8_t code = OP_STOP;
+  image_read(self, &code, sizeof(code));
+  uint16_t source = 0;
+  image_read(self, &source, sizeof(source));
+  if (source >= self->module_count) { self->ok = false; }
+  struct pos pos;
+  pos_init(&pos, self->ok ? self->modules[source].source : 0, 0, 0);
+  image_read(self, &pos.line, sizeof(pos.line));
+  image_read(self, &pos.column, sizeof(pos.column));
+  if (code >= OP_STOP) { self->ok = false; }
+  if (!self->ok) { return op; }
+  op_init(op, code, new_form(self->vm, FORM_SEMI, pos));
+
+  switch (op->code) {
+  case OP_BRANCH:
+    op->as_branch.false_pc = image_read_pc(self);
+    break;
+  case OP_CALL:
+    op->as_call.func = image_read_func(self);
+    break;
+  case OP_DROP:
+    image_read(self, &op->as_drop.count, sizeof(op->as_drop.count));
+    break;
+  case OP_EQUAL:
+    image_read_val(self, &op->as_equal.x);
+    image_read_val(self, &op->as_equal.y);
+    break;
+  case OP_JUMP:
+    op->as_jump.pc = image_read_pc(self);
+    break;
+  case OP_LOAD:
+    image_read(self, &op->as_load.reg, sizeof(op->as_load.reg));
+    break;
+  case OP_NOP:
+    break;
+  case OP_PUSH:
+    image_read_val(self, &op->as_push.val);
+    break;
+  case OP_RET:
+    op->as_ret.func = image_read_func(self);
+    image_read(self, &op->as_ret.check, sizeof(op->as_ret.check));
+    break;
+  case OP_STORE:
+    image_read(self, &op->as_store.reg, sizeof(op->as_store.reg));
+    break;
+    //---STOP---
+  case OP_STOP:
+    break;
   }
 
- CALL: {
-    struct op_call *call = &op->as_call;
-    DISPATCH(call->func->body(call->func, op+1, vm));
+  return op;
+}
+
+void image_write_func_def(struct image *self, struct func *func) {
+  image_write_name(self, func->name);
+  image_write(self, &func->nargs, sizeof(func->nargs));
+
+  for (struct func_arg *a = func->args; a < func->args + func->nargs; a++) {
+    image_write_name(self, a->name);
+    image_write_type(self, a->type);
+  }
+
+  image_write(self, &func->nrets, sizeof(func->nrets));
+
+  for (struct type **r = func->rets; r < func->rets + func->nrets; r++) {
+    image_write_type(self, *r);
+  }
+
+  if (func->body != __func_body) { self->ok = false; }
+  image_write_pc(self, func->start_pc);
+}
+
+struct func *image_read_func_def(struct image *self, struct func *func) {
+  char name[MAX_NAME_LENGTH];
+  image_read_name(self, name, MAX_NAME_LENGTH);
+  struct func_arg args[MAX_FUNC_ARG_COUNT];
+  uint8_t nargs = 0;
+  image_read(self, &nargs, sizeof(nargs));
+  if (nargs > MAX_FUNC_ARG_COUNT) { self->ok = false; }
+  
+  for (struct func_arg *a = args; self->ok && a < args + nargs; a++) {
+    image_read_name(self, a->name, MAX_NAME_LENGTH);
+    a->type = image_read_type(self);
   }
+
+  struct type *rets[MAX_FUNC_RET_COUNT];
+  uint8_t nrets = 0;
+  image_read(self, &nrets, sizeof(nrets));
+  if (nrets > MAX_FUNC_RET_COUNT) { self->ok = false; }
   
- DROP: {
-    struct op_drop *drop = &op->as_drop;
-    struct state *state = peek_state(vm);
-    if (state->stack_size < drop->count) {
-      error(vm, op->form->pos, "Not enough values");
-      return EVAL_ERROR;
+  for (struct type **r = rets; self->ok && r < rets + nrets; r++) {
+    *r = image_read_type(self);
+  }
+
+  struct op *start_pc = image_read_pc(self);
+  if (!self->ok) { return NULL; }
+  func_init(func, name, nargs, args, nrets, rets, __func_body);
+  func->start_pc = start_pc;
+  return func;
+}
+
+void image_write_module(struct image *self, struct module *m) {
+  struct vm *vm = self->vm;
+  char path[PATH_MAX];
+  struct stat st;
+  
+  if (!realpath(vm->sources[m->source], path) ||
+      strlen(path) >= MAX_POS_SOURCE_LENGTH ||
+      stat(path, &st) == -1) {
+    self->ok = false;
+    return;
+  }
+
+  image_write_name(self, path);
+  struct image_source s;
+  image_source_init(&s, &st);
+  image_write(self, &s, sizeof(s));
+  image_write_func(self, m->init);
+  uint8_t export_count = m->exports.item_count;
+  image_write(self, &export_count, sizeof(export_count));
+
+  LS_DO(&m->exports.order, i) {
+    struct env_item *it = BASEOF(i, struct env_item, order);
+    image_write_name(self, it->name);
+    image_write_val(self, &it->val);
+  }
+}
+
+/* The first module is the one being imported, the rest are registered as if imported while loading. */
+
+struct module *image_read_module(struct image *self, struct module *m) {
+  struct vm *vm = self->vm;
+  bool first = m == self->modules;
+  char path[MAX_POS_SOURCE_LENGTH];
+  image_read_name(self, path, MAX_POS_SOURCE_LENGTH);
+  struct image_source s, expected;
+  image_read(self, &s, sizeof(s));
+  struct stat st;
+  if (!self->ok) { return NULL; }
+  
+  if (!first) {
+    if (stat(path, &st) == -1 || find_module(vm, &st) || vm->source_count == MAX_SOURCE_COUNT) {
+      self->ok = false;
+      return NULL;
+    }
+    
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->source = new_source(vm, path);
+  } else if (stat(vm->sources[m->source], &st) == -1) {
+    self->ok = false;
+    return NULL;
+  }
+
+  image_source_init(&expected, &st);
+  
+  if (memcmp(&s, &expected, sizeof(s)) != 0) {
+    self->ok = false;
+    return NULL;
+  }
+  
+  m->init = image_read_func(self);
+  env_init(&m->exports);
+  uint8_t export_count = 0;
+  image_read(self, &export_count, sizeof(export_count));
+
+  for (uint8_t i = 0; self->ok && i < export_count; i++) {
+    char name[MAX_NAME_LENGTH];
+    struct val v;
+    image_read_name(self, name, MAX_NAME_LENGTH);
+    image_read_val(self, &v);
+    struct val *ev = self->ok ? env_set(&m->exports, name) : NULL;
+    
+    if (ev) {
+      *ev = v;
+    } else {
+      self->ok = false;
+    }
+  }
+
+  return m;
+}
+
+bool cache_path(const char *path, const char *suffix, char *out) {
+  return snprintf(out, MAX_POS_SOURCE_LENGTH+8, "%sc%s", path, suffix) < MAX_POS_SOURCE_LENGTH+8;
+}
+
+/* Writes the image of a freshly compiled module, which starts at its init func and ends at the current pc.
+   Images are written to a unique temporary file next to the cache and renamed into place, 
+   which keeps processes compiling the same module at once from interleaving their writes. */
+
+bool module_save(struct vm *vm, struct module *m, const char *path) {
+  char cache[MAX_POS_SOURCE_LENGTH+8], tmp[MAX_POS_SOURCE_LENGTH+8];
+  if (!cache_path(path, "", cache) || !cache_path(path, ".XXXXXX", tmp)) { return false; }
+  int fd = mkstemp(tmp);
+  if (fd == -1) { return false; }
+  FILE *f = (fchmod(fd, 0644) == 0) ? fdopen(fd, "wb") : NULL;
+
+  if (!f) {
+    close(fd);
+    remove(tmp);
+    return false;
+  }
+  
+  struct image img;
+  image_init(&img, vm, f,
+	     m, vm->modules + vm->module_count - m,
+	     m->init, vm->funcs + vm->func_count - m->init,
+	     m->init->start_pc, pc(vm) - m->init->start_pc);
+
+  struct image_header h;
+  image_header_init(&h, img.module_count, img.func_count, img.op_count);
+  image_write(&img, &h, sizeof(h));
+
+  for (struct module *im = img.modules; im < img.modules + img.module_count; im++) {
+    image_write_module(&img, im);
+  }
+  
+  for (struct func *fn = img.funcs; fn < img.funcs + img.func_count; fn++) {
+    image_write_func_def(&img, fn);
+  }
+
+  for (struct op *op = img.ops; op < img.ops + img.op_count; op++) {
+    image_write_op(&img, op);
+  }
+
+  bool ok = img.ok;
+  if (fclose(f) != 0) { ok = false; }
+  if (ok) { ok = rename(tmp, cache) == 0; }
+  if (!ok) { remove(tmp); }
+  return ok;
+}
+
+/* Loads a cached image at the current pc, provided it was written by this version from the same sources. */
+
+bool module_load(struct vm *vm, struct module *m, const char *path) {
+  char cache[MAX_POS_SOURCE_LENGTH+8];
+  if (!cache_path(path, "", cache)) { return false; }
+  FILE *f = fopen(cache, "rb");
+  if (!f) { return false; }
+
+  struct image img;
+  image_init(&img, vm, f, NULL, 0, NULL, 0, NULL, 0);
+  struct image_header h, expected;
+  image_read(&img, &h, sizeof(h));
+  image_header_init(&expected, h.module_count, h.func_count, h.op_count);
+  
+  if (!img.ok ||
+      memcmp(&h, &expected, sizeof(h)) != 0 ||
+      !h.module_count || !h.func_count ||
+      m - vm->modules + h.module_count > MAX_MODULE_COUNT ||
+      vm->func_count + h.func_count > MAX_FUNC_COUNT ||
+      vm->op_count + h.op_count > MAX_OP_COUNT ||
+      vm->forms.count + h.op_count > MAX_FORM_COUNT) {
+    fclose(f);
+    return false;
+  }
+
+  uint16_t source_count = vm->source_count;
+  form_t form_count = vm->forms.count;
+  img.modules = m;
+  img.module_count = h.module_count;
+  img.funcs = vm->funcs + vm->func_count;
+  img.func_count = h.func_count;
+  img.ops = vm->ops + vm->op_count;
+  img.op_count = h.op_count;
+
+  for (struct module *im = img.modules; img.ok && im < img.modules + img.module_count; im++) {
+    image_read_module(&img, im);
+  }
+
+  for (struct func *fn = img.funcs; img.ok && fn < img.funcs + img.func_count; fn++) {
+    image_read_func_def(&img, fn);
+  }
+
+  for (struct op *op = img.ops; img.ok && op < img.ops + img.op_count; op++) {
+    image_read_op(&img, op);
+  }
+
+  fclose(f);
+
+  if (!img.ok) {
+    m->init = NULL;
+    vm->source_count = source_count;
+    vm->forms.count = form_count;
+    return false;
+  }
+
+  vm->module_count += img.module_count - 1;
+  vm->func_count += img.func_count;
+  vm->op_count += img.op_count;
+  return true;
+}
+
+/* Compiles the module at the current pc as the body of its init func, in a scope of its own below the root. */
+
+enum emit_res module_compile(struct vm *vm, struct module *m, const char *path, form_t form) {
+  if (vm->func_count == MAX_FUNC_COUNT || vm->scope_count == MAX_SCOPE_COUNT) {
+    error(vm, form_pos(vm, form), (vm->func_count == MAX_FUNC_COUNT) ? "Too many funcs" : "Too many scopes");
+    return EMIT_ERROR;
+  }
+  
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    error(vm, form_pos(vm, form), "Failed importing %s: %s", path, strerror(errno));
+    return EMIT_ERROR;
+  }
+  
+  struct func *init = func_init(vm->funcs + vm->func_count++, "import",
+				0, (struct func_arg[]){}, 0, (struct type *[]){},
+				__func_body);
+  init->start_pc = pc(vm);
+  
+  struct scope *s = push_scope(vm), *ps = s->parent_scope;
+  s->parent_scope = vm->scopes;
+  s->reg_count = 0;
+  struct in in;
+  in_init(&in, fd);
+  struct pos pos;
+  pos_init(&pos, m->source, 0, 0);
+  enum emit_res res = EMIT_OK;
+
+  while (res == EMIT_OK) {
+    struct form_range forms;
+    pthread_mutex_lock(&vm->read_lock);
+    enum read_res rr = read_forms(vm, &pos, &in, &forms);
+    pthread_mutex_unlock(&vm->read_lock);
+    if (rr == READ_NULL) { break; }
+    
+    if (rr == READ_ERROR) {
+      strcpy(vm->error, in.error);
+      res = EMIT_ERROR;
+      break;
+    }
+    
+    res = emit_forms(vm, &forms);
+  }
+
+  close(fd);
+
+  form_t end = FORM_NULL;
+  
+  if (res == EMIT_OK) {
+    pthread_mutex_lock(&vm->read_lock);
+    end = new_form(vm, FORM_SEMI, pos);
+    if (end == FORM_NULL) { error(vm, form_pos(vm, form), "%s", forms_full(vm)); }
+    pthread_mutex_unlock(&vm->read_lock);
+    if (end == FORM_NULL) { res = EMIT_ERROR; }
+  }
+
+  if (res == EMIT_OK) {
+    emit(vm, OP_RET, end)->as_ret.func = init;
+    if (emit_full(vm, form)) { res = EMIT_ERROR; }
+  }
+  
+  if (res == EMIT_OK) {
+    env_init(&m->exports);
+    
+    LS_DO(&s->bindings.order, i) {
+      struct env_item *it = BASEOF(i, struct env_item, order);
+      *env_set(&m->exports, it->name) = it->val;
+    }
+
+    m->init = init;
+  }
+  
+  pop_scope(vm);
+  s->parent_scope = ps;
+  return res;
+}
+
+/* Binds exports in the current scope, importing the same module twice into a scope is fine. */
+
+enum emit_res bind_exports(struct vm *vm, struct module *m, form_t form) {
+  struct env *bindings = &peek_scope(vm)->bindings;
+  
+  LS_DO(&m->exports.order, i) {
+    struct env_item *it = BASEOF(i, struct env_item, order);
+    struct val *v = env_get(bindings, it->name);
+
+    if (v) {
+      if (v->type == it->val.type && v->as_func == it->val.as_func) { continue; }
+      error(vm, form_pos(vm, form), "Dup binding: %s", it->name);
+      return EMIT_ERROR;
+    }
+
+    v = bind_id(vm, it->name);
+    
+    if (!v) {
+      error(vm, form_pos(vm, form), "Too many bindings: %s", it->name);
+      return EMIT_ERROR;
     }
     
-    state->stack_size -= drop->count; 
-    DISPATCH(op+1);
+    *v = it->val;
   }
+
+  return EMIT_OK;
+}
+
+/* Paths are relative to the importing source. */
+
+bool module_path(struct vm *vm, uint16_t source, const char *name, char *out) {
+  const char *s = vm->sources[source], *slash = strrchr(s, '/');
   
- EQUAL: {
-    struct op_equal *equal = &op->as_equal;
-    struct val x = equal->x, y = equal->y;
-    if (!y.type) { y = *pop(vm); }
-    if (!x.type) { x = *pop(vm); }
-    push_init(vm, &vm->bool_type)->as_bool = val_equal(&x, &y);
-    DISPATCH(op+1);
-  }
+  int n = (*name == '/' || !slash)
+    ? snprintf(out, MAX_POS_SOURCE_LENGTH, "%s", name)
+    : snprintf(out, MAX_POS_SOURCE_LENGTH, "%.*s/%s", (int)(slash - s), s, name);
+  
+  return n < MAX_POS_SOURCE_LENGTH;
+}
 
- JUMP: {
-    struct op_jump *jump = &op->as_jump;
-    DISPATCH(jump->pc);
+enum emit_res import_body(struct macro *self, form_t form, struct form_range *in, struct vm *vm) {
+  form_t pf = pop_form(vm, in);
+  
+  if (form_type(vm, pf) != FORM_LIT || form_lit(vm, pf)->type != &str_type) {
+    error(vm, form_pos(vm, pf), "Invalid import path");
+    return EMIT_ERROR;
   }
 
- LOAD: {
-    *reg(vm, op->as_load.reg) = *pop(vm);
-    DISPATCH(op+1);
-  }
+  char path[MAX_POS_SOURCE_LENGTH];
 
- NOP: {
-    while ((op+1)->code == OP_NOP) { op++; }
-    DISPATCH(op);
+  if (!module_path(vm, form_pos(vm, form).source, form_lit(vm, pf)->as_str, path)) {
+    error(vm, form_pos(vm, pf), "Import path too long");
+    return EMIT_ERROR;
   }
+
+  struct stat st;
   
- PUSH: {
-    *push(vm) = op->as_push.val;
-    DISPATCH(op+1);
+  if (stat(path, &st) == -1) {
+    error(vm, form_pos(vm, form), "Failed importing %s: %s", path, strerror(errno));
+    return EMIT_ERROR;
   }
 
- RET: {
-    struct frame *f = pop_frame(vm);
-    DISPATCH(f->ret_pc);
+  struct module *m = find_module(vm, &st);
+
+  if (m && !m->init) {
+    error(vm, form_pos(vm, form), "Recursive import: %s", path);
+    return EMIT_ERROR;
   }
   
- STORE: {
-    *push(vm) = *reg(vm, op->as_store.reg);
-    DISPATCH(op+1);    
+  if (!m) {
+    if (vm->module_count == MAX_MODULE_COUNT || vm->source_count == MAX_SOURCE_COUNT) {
+      error(vm, form_pos(vm, form), "Too many modules");
+      return EMIT_ERROR;
+    }
+    
+    m = vm->modules + vm->module_count++;
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->source = new_source(vm, path);
+    m->init = NULL;
+    struct op_jump *skip = &emit(vm, OP_JUMP, form)->as_jump;
+    pthread_mutex_lock(&vm->read_lock);
+    bool loaded = module_load(vm, m, path);
+    pthread_mutex_unlock(&vm->read_lock);
+
+    if (!loaded) {
+      if (module_compile(vm, m, path, form) != EMIT_OK) {
+	m->dev = 0;
+	m->ino = 0;
+	return EMIT_ERROR;
+      }
+      
+      module_save(vm, m, path);
+    }
+
+    skip->pc = pc(vm);
+    emit(vm, OP_CALL, form)->as_call.func = m->init;
   }
-  
- STOP: {}
 
-  return EVAL_OK;
+  return bind_exports(vm, m, form);
 }
 
-/*** Readers
-     Readers transform code into forms.
-     New readers must be added in the right order to read_form().
+/*** Marks
+     Marks are taken before evaluating each top-level batch of forms, 
+     the ops, forms, literals and funcs added since are rolled back once it's done unless they're still in use.
+     That is, unless the batch bound, redefined or imported anything, left fibers running, 
+     or left values referring to its forms or funcs on the stack, in registers or in channels.
 ***/
 
-typedef enum read_res(*reader_t)(struct vm *vm, struct pos *pos, FILE *in, struct ls *out);
+struct mark {
+  struct vm *vm;
+  uint32_t func_count, macro_count, module_count, op_count, lit_count;
+  form_t form_count;
+  uint8_t binding_count;
+};
 
-enum read_res read_group(struct vm *vm, struct pos *pos, FILE *in, struct ls *out);
-enum read_res read_id(struct vm *vm, struct pos *pos, FILE *in, struct ls *out);
-enum read_res read_int(struct vm *vm, struct pos *pos, FILE *in, struct ls *out);
-enum read_res read_semi(struct vm *vm, struct pos *pos, FILE *in, struct ls *out);
-enum read_res read_ws(struct vm *vm, struct pos *pos, FILE *in, struct ls *out);
+struct mark *mark_init(struct mark *self, struct vm *vm) {
+  self->vm = vm;
+  self->func_count = vm->func_count;
+  self->macro_count = vm->macro_count;
+  self->module_count = vm->module_count;
+  self->op_count = vm->op_count;
+  self->lit_count = vm->forms.lit_count;
+  self->form_count = vm->forms.count;
+  self->binding_count = peek_scope(vm)->bindings.item_count;
+  return self;
+}
 
-enum read_res read_form(struct vm *vm, struct pos *pos, FILE *in, struct ls *out) {
-  static const int COUNT = 5;
-  static const reader_t readers[COUNT] = {read_ws, read_int, read_semi, read_group, read_id};
+bool mark_refers(struct mark *self, struct val *val);
 
-  for (int i=0; i < COUNT; i++) {
-    switch (readers[i](vm, pos, in, out)) {
-    case READ_OK:
-      return READ_OK;
-    case READ_NULL:
-      break;
-    case READ_ERROR:
-      return READ_ERROR;
+bool node_refers(struct mark *self, struct node *node, uint8_t shift) {
+  if (!node) { return false; }
+  
+  for (uint8_t i = 0; i < NODE_WIDTH; i++) {
+    if (shift ? node_refers(self, node->children[i], shift - NODE_BITS) :
+	(node->items[i].type && mark_refers(self, node->items+i))) {
+      return true;
     }
   }
 
-  return READ_NULL;
+  return false;
 }
 
-enum read_res read_group(struct vm *vm, struct pos *pos, FILE *in, struct ls *out) {
-  struct pos fpos = *pos;  
-  char c = fgetc(in);
+bool entry_clear(struct map_entry *e, void *self) {
+  return !mark_refers(self, &e->key) && !mark_refers(self, &e->val);
+}
+
+bool mark_refers(struct mark *self, struct val *val) {
+  struct vm *vm = self->vm;
   
-  if (c != '(') {
-    ungetc(c, in);
-    return READ_NULL;
+  if (val->type == &func_type) {
+    return val->as_func >= vm->funcs + self->func_count && val->as_func < vm->funcs + MAX_FUNC_COUNT;
   }
 
-  pos->column++;
-  struct form *f = new_form(vm, FORM_GROUP, fpos, out);
-
-  for (;;) {
-    c = fgetc(in);
+  if (val->type == &quote_type) { return val->as_quote >= self->form_count; }
+  if (val->type == &vec_type) { return node_refers(self, val->as_vec, val->as_vec ? val->as_vec->shift : 0); }
+  if (val->type == &dict_type) { return !dict_each(val->as_dict, entry_clear, self); }
+  return false;
+}
 
-    if (!c || c == ')') {
-      break;
-    }
+bool mark_used(struct mark *self) {
+  struct vm *vm = self->vm;
+  
+  if (vm->macro_count != self->macro_count ||
+      vm->module_count != self->module_count ||
+      peek_scope(vm)->bindings.item_count != self->binding_count ||
+      vm->fiber_count > 1) {
+    return true;
+  }
 
-    ungetc(c, in);
+  for (struct func *f = vm->funcs; f < vm->funcs + self->func_count; f++) {
+    if (f->start_pc >= vm->ops + self->op_count && f->start_pc < vm->ops + MAX_OP_COUNT) { return true; }
+  }
 
-    enum read_res res = read_form(vm, pos, in, &f->as_group.items);
+  for (struct state *s = vm->states; s < vm->states + vm->state_count; s++) {
+    for (uint8_t i = 0; i < s->stack_size; i++) {
+      struct val v = stack_get(s, i);
+      if (mark_refers(self, &v)) { return true; }
+    }
 
-    switch (res) {
-    case READ_NULL:
-      c = 0;
-      break;
-    case READ_ERROR:
-      return res;
-    case READ_OK:
-      break;
+    for (reg_t i = 0; i < MAX_REG_COUNT; i++) {
+      struct val v = reg_get(s, i);
+      if (v.type && mark_refers(self, &v)) { return true; }
     }
   }
 
-  if (!c) {
-    error(vm, fpos, "Open group");
-    return READ_ERROR;
+  for (struct channel *c = vm->channels; c < vm->channels + vm->channel_count; c++) {
+    for (uint32_t i = c->head; i != c->tail; i++) {
+      if (mark_refers(self, c->items + i % MAX_CHANNEL_LENGTH)) { return true; }
+    }
   }
 
-  pos->column++;
-  return READ_OK;
+  return false;
 }
 
-enum read_res read_id(struct vm *vm, struct pos *pos, FILE *in, struct ls *out) {
-  struct pos fpos = *pos;
-  char name[MAX_NAME_LENGTH], *p = name, c = 0;
-  
-  while ((c = fgetc(in))) {
-    assert(p < name + MAX_NAME_LENGTH);
+void rollback(struct mark *self) {
+  struct vm *vm = self->vm;
+  vm->func_count = self->func_count;
+  vm->op_count = self->op_count;
+  vm->forms.lit_count = self->lit_count;
+  vm->forms.count = self->form_count;
+}
+
+/* Rolls back to the mark unless what's been added since is still in use. */
 
-    if (isspace(c) || c == '(' || c == ')' || c == ';') {
-      ungetc(c, in);
+void reclaim(struct mark *self) {
+  if (!mark_used(self)) { rollback(self); }
+}
+
+/* Evaluates fd as a script, reading on a separate thread; errors end up in vm->error.
+   Yields are resumed right away, what each batch leaves behind is reclaimed once it's done. */
+
+enum eval_res eval_script(struct vm *vm, int fd, uint16_t source) {
+  struct in in;
+  in_init(&in, fd);
+  struct pos pos;
+  pos_init(&pos, source, 0, 0);
+  struct pipeline p;
+  pipeline_init(&p, vm, &in, pos);
+  pipeline_start(&p);
+  enum eval_res res = EVAL_OK;
+    
+  for (;;) {
+    struct mark m;
+    mark_init(&m, vm);
+    struct batch b = pipeline_next(&p);
+    if (b.res == READ_NULL) { break; }
+      
+    if (b.res == READ_ERROR) {
+      res = EVAL_ERROR;
       break;
     }
-    
-    *p++ = c;
-    pos->column++;
+
+    res = eval_forms(vm, &b.forms);
+    while (res == EVAL_YIELD) { res = eval(vm, vm->resume_pc); }
+    if (res != EVAL_OK) { break; }
+    reclaim(&m);
   }
 
-  if (p == name) { return READ_NULL; }
-  
-  *p = 0;
-  struct form *f = new_form(vm, FORM_ID, fpos, out);
-  strcpy(f->as_id.name, name);
-  return READ_OK;
+  pipeline_stop(&p);
+  return res;
 }
 
-enum read_res read_int(struct vm *vm, struct pos *pos, FILE *in, struct ls *out) {
-  int_t v = 0;
-  bool neg = false;
-  struct pos fpos = *pos;
-  
-  char c = fgetc(in);
-  if (!c) { return READ_NULL; }
+/*** Servers
+     Servers evaluate requests from a Unix socket on a pool of warm VMs, each owned by a worker thread blocking in accept().
+     A request is the source up to end of input, the response either the final stack or the first error.
+     Between requests, VMs are rolled back to where they were after initialization and running the prelude.
+     Requests may be given a fuel limit and a deadline in milliseconds, 
+     running out of either is reported as an error to keep workers from being hogged.
+***/
 
-  if (c == '-') {
-    c = fgetc(in);
+struct server;
 
-    if (isdigit(c)) {
-      neg = true;
-      pos->column++;
-      ungetc(c, in);
-    } else {
-      ungetc(c, in);
-      ungetc('-', in);
-      return READ_NULL;
-    }
-  } else {
-    ungetc(c, in);
-  }
+struct worker {
+  struct server *server;
+  struct vm vm;
+  pthread_t thread;
+};
 
-  while ((c = fgetc(in))) {
-    if (!isdigit(c)) {
-      ungetc(c, in);
+struct server {
+  int fd;
+  struct vm snapshot;
+  struct worker workers[MAX_WORKER_COUNT];
+  uint32_t worker_count;
+  uint64_t fuel, deadline;
+};
+
+/* Every request is evaluated in a fresh clone of the server's snapshot. */
+
+void worker_serve(struct worker *self, int conn) {
+  struct vm *vm = vm_clone(&self->vm, &self->server->snapshot);
+  vm->fuel_limit = self->server->fuel;
+  if (self->server->deadline) { vm->deadline = now_ms() + self->server->deadline; }
+  refuel(vm);
+  push_state(vm);
+  
+  struct in in;
+  in_init(&in, conn);
+  struct pos pos;
+  const char *message = (vm->source_count == MAX_SOURCE_COUNT) ? "Too many sources" : NULL;
+  if (!message) { pos_init(&pos, new_source(vm, "request"), 0, 0); }
+  
+  while (!message) {
+    struct mark m;
+    mark_init(&m, vm);
+    struct form_range forms;
+    enum read_res rr = read_forms(vm, &pos, &in, &forms);
+    if (rr == READ_NULL) { break; }
+    
+    if (rr == READ_ERROR) {
+      message = in.error;
       break;
     }
     
-    v *= 10;
-    v += c - '0';
-    pos->column++;
+    enum eval_res res = eval_forms(vm, &forms);
+    
+    if (res == EVAL_YIELD) {
+      error(vm, form_pos(vm, vm->resume_pc->form), "Out of fuel");
+    }
+    
+    if (res != EVAL_OK) {
+      message = vm->error;
+      break;
+    }
+
+    reclaim(&m);
   }
 
-  if (pos->column == fpos.column) { return READ_NULL; }
-  struct form *f = new_form(vm, FORM_LIT, fpos, out);
-  val_init(&f->as_lit.val, &vm->int_type)->as_int = neg ? -v : v;
-  return READ_OK;
-}
+  FILE *out = fdopen(conn, "w");
 
-enum read_res read_semi(struct vm *vm, struct pos *pos, FILE *in, struct ls *out) {
-  struct pos fpos = *pos;
-  char c = 0;
-  
-  if (!(c = fgetc(in))) { return READ_NULL; }
-  
-  if (c != ';') {
-    ungetc(c, in);
-    return READ_NULL;
+  if (!out) {
+    close(conn);
+    return;
   }
   
-  pos->column++;
-  new_form(vm, FORM_SEMI, fpos, out);
-  return READ_OK;
+  if (message) {
+    fputs(message, out);
+  } else {
+    dump_stack(vm, out);
+  }
+
+  fputc('\n', out);
+  fclose(out);
 }
-    
-enum read_res read_ws(struct vm *vm, struct pos *pos, FILE *in, struct ls *out) {
-  char c = 0;
 
-  while ((c = fgetc(in))) {
-    switch (c) {
-    case ' ':
-    case '\t':
-      pos->column++;
-      break;
-    case '\n':
-      pos->line++;
-      pos->column = 0;
+void *worker_run(void *arg) {
+  struct worker *self = arg;
+  
+  for (;;) {
+    int conn = accept(self->server->fd, NULL, NULL);
+    
+    if (conn == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) { continue; }
+      fprintf(stderr, "Failed accepting: %s\n", strerror(errno));
       break;
-    default:
-      ungetc(c, in);
-      return READ_NULL;
     }
+    
+    worker_serve(self, conn);
   }
-  
-  return READ_NULL;
-}
 
-void macro_dump(struct val *val, FILE *out) {
-  fprintf(out, "Macro(%s)", val->as_macro->name);
+  return NULL;
 }
 
-enum emit_res macro_emit(struct val *val, struct form *form, struct ls *in, struct vm *vm) {
-  struct macro *self = val->as_macro;
-  struct ls *a = in->next;
+/* Capacity is one request per worker, pending connections beyond the listen backlog are refused. */
 
-  for (uint8_t i = 0; i < self->nargs; i++, a = a->next) {
-    if (a == in) {
-      error(vm, form->pos, "Missing macro arguments: %s %" PRIu8, self->name, i);
-      return EMIT_ERROR;
+bool server_init(struct server *self, const char *path, const char *prelude,
+		 uint32_t worker_count, uint64_t fuel, uint64_t deadline) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return false;
+  }
+
+  strcpy(addr.sun_path, path);
+  struct vm *vm = vm_init(&self->snapshot);
+  push_state(vm);
+  
+  if (prelude) {
+    int fd = open(prelude, O_RDONLY);
+
+    if (fd == -1) {
+      fprintf(stderr, "Failed opening %s: %s\n", prelude, strerror(errno));
+      return false;
+    }
+
+    enum eval_res res = eval_script(vm, fd, new_source(vm, prelude));
+    close(fd);
+    
+    if (res != EVAL_OK) {
+      fprintf(stderr, "%s\n", vm->error);
+      return false;
     }
   }
 
-  return self->body(self, form, in, vm);
-}
+  vm_snapshot(vm);
+  self->worker_count = worker_count;
+  self->fuel = fuel;
+  self->deadline = deadline;
+  
+  for (struct worker *w = self->workers; w < self->workers + self->worker_count; w++) {
+    w->server = self;
+  }
 
-struct val *macro_lit(struct val *val) {
-  return NULL;
-}
+  self->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  
+  if (self->fd == -1 ||
+      bind(self->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(self->fd, MAX_WORKER_COUNT) == -1) {
+    fprintf(stderr, "Failed serving %s: %s\n", path, strerror(errno));
+    return false;
+  }
 
-struct op *add_body(struct func *self, struct op *ret_pc, struct vm *vm) {
-  struct val y = *pop(vm);
-  struct val *x = peek(vm);
-  x->as_int += y.as_int;
-  return ret_pc;
+  return true;
 }
 
-struct op *debug_body(struct func *self, struct op *ret_pc, struct vm *vm) {
-  vm->debug = !vm->debug;
-  push_init(vm, &vm->bool_type)->as_bool = vm->debug;
-  return ret_pc;
+/* Write protects the pages that lie entirely within [start, end). */
+
+void protect_pages(void *start, void *end) {
+  uintptr_t size = sysconf(_SC_PAGESIZE);
+  uintptr_t s = ((uintptr_t)start + size - 1) & ~(size - 1), e = (uintptr_t)end & ~(size - 1);
+  if (s < e) { mprotect((void *)s, e - s, PROT_READ); }
 }
 
-enum emit_res equal_body(struct macro *self, struct form *form, struct ls *in, struct vm *vm) {
-  struct op_equal *op = &emit(vm, OP_EQUAL, form)->as_equal;
+/* Forked workers share the snapshot copy-on-write, 
+   which is write protected to make sure it stays shared. */
 
-  struct form *x = BASEOF(ls_del(in->next), struct form, ls);
-  struct val *xv = form_val(x, vm);
+pid_t fork_worker(struct worker *w) {
+  pid_t pid = fork();
   
-  if (xv) {
-    op->x = *xv;
-  } else {
-    enum emit_res fr = form_emit(x, in, vm);
-    if (fr != EMIT_OK) { return fr; }
+  if (!pid) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    protect_pages(&w->server->snapshot, &w->server->snapshot + 1);
+    worker_run(w);
+    _exit(1);
   }
 
-  struct form *y = BASEOF(ls_del(in->next), struct form, ls);
-  struct val *yv = form_val(y, vm);
+  return pid;
+}
 
-  if (yv) {
-    op->y = *yv;
-  } else {
-    enum emit_res fr = form_emit(y, in, vm);
-    if (fr != EMIT_OK) { return fr; }
-  }
+static volatile sig_atomic_t stopping = 0;
 
-  return EMIT_OK;
+void stop(int signal) {
+  stopping = 1;
 }
 
-struct op *__func_body(struct func *self, struct op *ret_pc, struct vm *vm) {
-  push_frame(vm, self, ret_pc);
-  return self->start_pc;
+void nap_ms(uint64_t ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+  nanosleep(&ts, NULL);
 }
 
-enum emit_res func_body(struct macro *self, struct form *form, struct ls *in, struct vm *vm) {
-  struct form *name_form = BASEOF(ls_del(in->next), struct form, ls);
-  const char *name = name_form->as_id.name;
+/* Keeps fork_count workers running, replacing any that exit until SIGTERM or SIGINT stops them all.
+   Workers that exit within MIN_WORKER_LIFETIME ms are replaced after a delay that doubles with each one,
+   which keeps persistent failures such as running out of descriptors from turning into a fork loop. */
+
+int serve_forked(struct server *self, uint32_t fork_count) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
   
-  struct form *args_form = BASEOF(ls_del(in->next), struct form, ls);
-  struct func_arg args[MAX_FUNC_ARG_COUNT];
-  uint8_t nargs = 0;
+  pid_t pids[MAX_FORK_COUNT];
+  uint64_t started[MAX_FORK_COUNT];
+  for (uint32_t i = 0; i < fork_count; i++) { pids[i] = -1; }
+  uint64_t delay = 0;
   
-  struct form *rets_form = BASEOF(ls_del(in->next), struct form, ls);
-  struct type *rets[MAX_FUNC_RET_COUNT];
-  uint8_t nrets = 0;
+  while (!stopping) {
+    for (uint32_t i = 0; i < fork_count; i++) {
+      if (pids[i] != -1) { continue; }
+      started[i] = now_ms();
+      if ((pids[i] = fork_worker(self->workers)) == -1) { fprintf(stderr, "Failed forking: %s\n", strerror(errno)); }
+    }
 
-  struct func *func = func_init(vm->funcs + vm->func_count++, name, nargs, args, nrets, rets, __func_body);
-  struct form *body = BASEOF(ls_del(in->next), struct form, ls);
-  enum emit_res res = func_emit(func, body, in, vm);
-  if (res != EMIT_OK) { return res; }
-  
-  if (strcmp(name, "_") == 0) {
-    push_init(vm, &vm->func_type)->as_func = func;
-  } else {
-    bind_init(vm, name, &vm->func_type)->as_func = func; 
+    pid_t pid = wait(NULL);
+    
+    if (pid == -1) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+
+    uint32_t i = 0;
+    while (i < fork_count && pids[i] != pid) { i++; }
+    if (i == fork_count) { continue; }
+    pids[i] = -1;
+    
+    if (now_ms() - started[i] < MIN_WORKER_LIFETIME) {
+      delay = delay ? (delay * 2 < MAX_RESPAWN_DELAY ? delay * 2 : MAX_RESPAWN_DELAY) : MIN_RESPAWN_DELAY;
+      nap_ms(delay);
+    } else {
+      delay = 0;
+    }
   }
 
-  return EMIT_OK;
-}
+  for (uint32_t i = 0; i < fork_count; i++) {
+    if (pids[i] != -1) { kill(pids[i], SIGTERM); }
+  }
 
-enum emit_res if_body(struct macro *self, struct form *form, struct ls *in, struct vm *vm) {
-  struct form *cf = BASEOF(ls_del(in->next), struct form, ls);
-  enum emit_res fr = form_emit(cf, in, vm);
-  if (fr != EMIT_OK) { return fr; }
-  struct op_branch *b = &emit(vm, OP_BRANCH, form)->as_branch;
+  while (wait(NULL) != -1 || errno == EINTR);
+  return stopping ? 0 : 1;
+}
 
-  struct form *tf = BASEOF(ls_del(in->next), struct form, ls);
-  fr = form_emit(tf, in, vm);
-  if (fr != EMIT_OK) { return fr; }
+int serve(const char *path, uint32_t fork_count, uint64_t fuel, uint64_t deadline, const char *prelude) {
+  static struct server server;
+  signal(SIGPIPE, SIG_IGN);
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t worker_count = fork_count ? 1 : (ncpus > 0 && ncpus < MAX_WORKER_COUNT) ? ncpus : MAX_WORKER_COUNT;
 
-  struct op_jump *j = &emit(vm, OP_JUMP, form)->as_jump;
-  b->false_pc = pc(vm);
-  struct form *ff = BASEOF(ls_del(in->next), struct form, ls);
-  fr = form_emit(ff, in, vm);
-  if (fr != EMIT_OK) { return fr; }
-  j->pc = pc(vm);
+  if (fork_count > MAX_FORK_COUNT) {
+    fprintf(stderr, "Too many forks: %" PRIu32 "\n", fork_count);
+    return 1;
+  }
   
-  return EMIT_OK;
-}
-
-enum emit_res nop_body(struct macro *self, struct form *form, struct ls *in, struct vm *vm) {
-  return EMIT_OK;
-}
+  if (!server_init(&server, path, prelude, worker_count, fuel, deadline)) { return 1; }
+  if (fork_count) { return serve_forked(&server, fork_count); }
+  
+  /* Workers that fail to start are left out, the rest serve without them. */
+  
+  for (struct worker *w = server.workers + 1; w < server.workers + server.worker_count; w++) {
+    int err = pthread_create(&w->thread, NULL, worker_run, w);
+    if (err) { fprintf(stderr, "Failed starting worker: %s\n", strerror(err)); }
+  }
 
-struct op *sub_body(struct func *self, struct op *ret_pc, struct vm *vm) {
-  struct val y = *pop(vm);
-  struct val *x = peek(vm);
-  x->as_int -= y.as_int;
-  return ret_pc;
+  worker_run(server.workers);
+  return 1;
 }
 
-int main () {
-  printf("fibr %d\n\n", VERSION);
+int main(int argc, char *argv[]) {
+  if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+    uint32_t fork_count = 0;
+    uint64_t fuel = 0, deadline = 0;
+    int i = 3;
+    
+    for (; i+1 < argc; i += 2) {
+      if (strcmp(argv[i], "--deadline") == 0) {
+	deadline = strtoull(argv[i+1], NULL, 10);
+      } else if (strcmp(argv[i], "--fork") == 0) {
+	fork_count = strtoul(argv[i+1], NULL, 10);
+      } else if (strcmp(argv[i], "--fuel") == 0) {
+	fuel = strtoull(argv[i+1], NULL, 10);
+      } else {
+	break;
+      }
+    }
+    
+    return serve(argv[2], fork_count, fuel, deadline, i < argc ? argv[i] : NULL);
+  }
   
-  struct vm vm;
+  static struct vm vm;
   vm_init(&vm);
   push_state(&vm);
 
-  struct type macro_type;
-  type_init(&macro_type, "Macro");
-  macro_type.methods.dump = macro_dump;
-  macro_type.methods.emit = macro_emit;
-  macro_type.methods.lit = macro_lit;
-  bind_init(&vm, "Macro", &vm.meta_type)->as_meta = &macro_type;
-  
-  struct func add_func;
-  func_init(&add_func, "+",
-	    2, (struct func_arg[]){arg("x", &vm.int_type), arg("y", &vm.int_type)},
-	    1, (struct type *[]){&vm.int_type},
-	    add_body);
-  bind_init(&vm, "+", &vm.func_type)->as_func = &add_func;
-
-  struct func debug_func;
-  func_init(&debug_func, "debug",
-	    0, (struct func_arg[]){},
-	    1, (struct type *[]){&vm.bool_type},
-	    debug_body);
-  bind_init(&vm, "debug", &vm.func_type)->as_func = &debug_func;
-
-  struct macro equal_macro;
-  macro_init(&equal_macro, "=", 2, equal_body);
-  bind_init(&vm, "=", &macro_type)->as_macro = &equal_macro;
-
-  struct macro func_macro;
-  macro_init(&func_macro, "func", 4, func_body);
-  bind_init(&vm, "func", &macro_type)->as_macro = &func_macro;
-
-  struct macro if_macro;
-  macro_init(&if_macro, "if", 3, if_body);
-  bind_init(&vm, "if", &macro_type)->as_macro = &if_macro;
-
-  struct macro nop_macro;
-  macro_init(&nop_macro, "_", 0, nop_body);
-  bind_init(&vm, "_", &macro_type)->as_macro = &nop_macro;
-
-  struct func sub_func;
-  func_init(&sub_func, "-",
-	    2, (struct func_arg[]){arg("x", &vm.int_type), arg("y", &vm.int_type)},
-	    1, (struct type *[]){&vm.int_type},
-	    sub_body);
-  bind_init(&vm, "-", &vm.func_type)->as_func = &sub_func;
-
-  struct pos pos;
-  pos_init(&pos, "repl", 0, 0);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = interrupt;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGINT, &sa, NULL);
 
-  while (!feof(stdin)) {
-    struct ls forms;
-    ls_init(&forms);
+  if (argc > 1) {
+    int fd = open(argv[1], O_RDONLY);
 
-    while (read_form(&vm, &pos, stdin, &forms) == READ_OK) {
-      struct form *f = BASEOF(forms.prev, struct form, ls);
+    if (fd == -1) {
+      fprintf(stderr, "Failed opening %s: %s\n", argv[1], strerror(errno));
+      return 1;
+    }
 
-      if (f->type == FORM_SEMI) {
-	ls_del(forms.prev);
-	break;
-      }
+    enum eval_res res = eval_script(&vm, fd, new_source(&vm, argv[1]));
+    close(fd);
+    
+    if (res != EVAL_OK) {
+      printf("%s\n", vm.error);
+      return 1;
     }
     
-    struct op *start_pc = pc(&vm);
+    dump_stack(&vm, stdout);
+    fputc('\n', stdout);
+    return 0;
+  }
 
-    if (emit_forms(&vm, &forms) != EMIT_OK) {
-      printf("%s\n", vm.error);
+  printf("fibr %d\n\n", VERSION);
+  struct pos pos;
+  pos_init(&pos, new_source(&vm, "repl"), 0, 0);
+  struct in in;
+  in_init(&in, STDIN_FILENO);
+  
+  for (;;) {
+    struct mark m;
+    mark_init(&m, &vm);
+    struct form_range forms;
+    enum read_res rr = read_forms(&vm, &pos, &in, &forms);
+    if (rr == READ_NULL) { break; }
+    
+    if (rr == READ_ERROR) {
+      printf("%s\n", in.error);
+      reclaim(&m);
       continue;
     }
-  
-    emit(&vm, OP_STOP, NULL);
     
-    if (eval(&vm, start_pc) != EVAL_OK) {
+    interrupted = 0;
+    enum eval_res res = eval_forms(&vm, &forms);
+    while (res == EVAL_YIELD) { res = eval(&vm, vm.resume_pc); }
+    
+    if (res != EVAL_OK) {
       printf("%s\n", vm.error);
-      continue;
+    } else {
+      dump_stack(&vm, stdout);
+      fputc('\n', stdout);
     }
 
-    dump_stack(&vm, stdout);
-    fputc('\n', stdout);
+    reclaim(&m);
   }
   
   return 0;